@@ -0,0 +1,632 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <chrono>
+#include <cstring>
+#include <sideband_compression.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t MinMatch = 4;
+static const int64_t LastLiterals = 5;
+static const int64_t MatchFindLimit = 12;
+static const int64_t MaxOffset = 65535;
+static const int HashBits = 12;
+
+//---------------------------------------------------------------------
+// A compressed payload starts with the decompressed length, the mode
+// and the element size, padded to 16 bytes.
+//---------------------------------------------------------------------
+static const int64_t CompressionHeaderSize = 16;
+
+//---------------------------------------------------------------------
+// Frames smaller than MinimumCompressedBytes are always sent as they
+// are.  The writer checks whether compression pays every
+// EvaluationFrames compressed frames and sends RetryFrames frames
+// uncompressed when it does not.
+//---------------------------------------------------------------------
+static const int64_t MinimumCompressedBytes = 512;
+static const int64_t EvaluationFrames = 16;
+static const int64_t RetryFrames = 1024;
+static const int64_t MaxUsefulPercent = 90;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t DefaultElementSize = 2;
+static const int64_t DefaultLinkBytesPerSecond = 3125000000;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static inline uint32_t Read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static inline uint64_t Read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static inline int TrailingZeroBytes(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<int>(index) >> 3;
+#else
+    return __builtin_ctzll(value) >> 3;
+#endif
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static inline uint32_t Hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - HashBits);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static inline uint8_t* WriteLength(uint8_t* output, int64_t length)
+{
+    while (length >= 255)
+    {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = static_cast<uint8_t>(length);
+    return output;
+}
+
+//---------------------------------------------------------------------
+// Writes the literals and, if matchLength is not 0, the match that
+// follows them.
+//---------------------------------------------------------------------
+static uint8_t* WriteSequence(uint8_t* output, const uint8_t* literals, int64_t literalLength, int64_t offset, int64_t matchLength)
+{
+    auto token = output++;
+    if (literalLength >= 15)
+    {
+        *token = 15 << 4;
+        output = WriteLength(output, literalLength - 15);
+    }
+    else
+    {
+        *token = static_cast<uint8_t>(literalLength << 4);
+    }
+    memcpy(output, literals, literalLength);
+    output += literalLength;
+    if (matchLength == 0)
+    {
+        return output;
+    }
+    *output++ = static_cast<uint8_t>(offset);
+    *output++ = static_cast<uint8_t>(offset >> 8);
+    matchLength -= MinMatch;
+    if (matchLength >= 15)
+    {
+        *token |= 15;
+        output = WriteLength(output, matchLength - 15);
+    }
+    else
+    {
+        *token |= static_cast<uint8_t>(matchLength);
+    }
+    return output;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t LzCompressBound(int64_t byteCount)
+{
+    return byteCount + byteCount / 255 + 16;
+}
+
+//---------------------------------------------------------------------
+// Greedy single pass compressor.  Positions that find no match are
+// skipped faster the longer the current run of literals gets, so data
+// that does not compress costs little time.  Returns 0 if destination
+// is smaller than LzCompressBound.
+//---------------------------------------------------------------------
+int64_t LzCompress(const uint8_t* source, int64_t byteCount, uint8_t* destination, int64_t capacity)
+{
+    if (capacity < LzCompressBound(byteCount))
+    {
+        return 0;
+    }
+    auto output = destination;
+    auto anchor = source;
+    auto end = source + byteCount;
+    if (byteCount > MatchFindLimit)
+    {
+        uint32_t table[1 << HashBits] = {};
+        auto matchLimit = end - LastLiterals;
+        auto inputLimit = end - MatchFindLimit;
+        auto input = source + 1;
+        while (input < inputLimit)
+        {
+            auto hash = Hash(Read32(input));
+            auto match = source + table[hash];
+            table[hash] = static_cast<uint32_t>(input - source);
+            if (input - match > MaxOffset || match >= input || Read32(match) != Read32(input))
+            {
+                input += 1 + ((input - anchor) >> 6);
+                continue;
+            }
+            while (input > anchor && match > source && input[-1] == match[-1])
+            {
+                --input;
+                --match;
+            }
+            auto matchLength = MinMatch;
+            while (input + matchLength + 8 <= matchLimit)
+            {
+                auto difference = Read64(input + matchLength) ^ Read64(match + matchLength);
+                if (difference != 0)
+                {
+                    matchLength += TrailingZeroBytes(difference);
+                    break;
+                }
+                matchLength += 8;
+            }
+            if (input + matchLength + 8 > matchLimit)
+            {
+                while (input + matchLength < matchLimit && input[matchLength] == match[matchLength])
+                {
+                    ++matchLength;
+                }
+            }
+            output = WriteSequence(output, anchor, input - anchor, input - match, matchLength);
+            input += matchLength;
+            anchor = input;
+            if (input < inputLimit)
+            {
+                table[Hash(Read32(input - 2))] = static_cast<uint32_t>(input - 2 - source);
+            }
+        }
+    }
+    output = WriteSequence(output, anchor, end - anchor, 0, 0);
+    return output - destination;
+}
+
+//---------------------------------------------------------------------
+// Fails unless the block decompresses to exactly decompressedCount
+// bytes, it never reads or writes outside the buffers.
+//---------------------------------------------------------------------
+bool LzDecompress(const uint8_t* source, int64_t byteCount, uint8_t* destination, int64_t decompressedCount)
+{
+    auto input = source;
+    auto inputEnd = source + byteCount;
+    auto output = destination;
+    auto outputEnd = destination + decompressedCount;
+    while (input < inputEnd)
+    {
+        auto token = *input++;
+        int64_t literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            uint8_t next;
+            do
+            {
+                if (input >= inputEnd || literalLength > decompressedCount)
+                {
+                    return false;
+                }
+                next = *input++;
+                literalLength += next;
+            } while (next == 255);
+        }
+        if (literalLength > inputEnd - input || literalLength > outputEnd - output)
+        {
+            return false;
+        }
+        if (literalLength <= 16 && inputEnd - input >= 16 && outputEnd - output >= 16)
+        {
+            // Short runs are copied with one fixed size copy, the bytes past
+            // the run are overwritten by what follows.
+            memcpy(output, input, 16);
+        }
+        else
+        {
+            memcpy(output, input, literalLength);
+        }
+        input += literalLength;
+        output += literalLength;
+        if (input == inputEnd)
+        {
+            break;
+        }
+        if (inputEnd - input < 2)
+        {
+            return false;
+        }
+        int64_t offset = input[0] | (input[1] << 8);
+        input += 2;
+        if (offset == 0 || offset > output - destination)
+        {
+            return false;
+        }
+        int64_t matchLength = token & 15;
+        if (matchLength == 15)
+        {
+            uint8_t next;
+            do
+            {
+                if (input >= inputEnd || matchLength > decompressedCount)
+                {
+                    return false;
+                }
+                next = *input++;
+                matchLength += next;
+            } while (next == 255);
+        }
+        matchLength += MinMatch;
+        if (matchLength > outputEnd - output)
+        {
+            return false;
+        }
+        auto match = output - offset;
+        if (matchLength <= 16 && offset >= 8 && outputEnd - output >= 16)
+        {
+            memcpy(output, match, 8);
+            memcpy(output + 8, match + 8, 8);
+            output += matchLength;
+            continue;
+        }
+        if (offset < 8)
+        {
+            // The match repeats itself every offset bytes, copy up to the
+            // first repeat that is at least 8 bytes back and copy the rest
+            // from there in 8 byte chunks.
+            auto period = offset * ((8 + offset - 1) / offset);
+            for (auto x = period - offset; x > 0 && matchLength > 0; --x, --matchLength)
+            {
+                *output++ = *match++;
+            }
+            match = output - period;
+        }
+        for (; matchLength >= 8; matchLength -= 8, output += 8, match += 8)
+        {
+            memcpy(output, match, 8);
+        }
+        for (; matchLength > 0; --matchLength)
+        {
+            *output++ = *match++;
+        }
+    }
+    return output == outputEnd;
+}
+
+//---------------------------------------------------------------------
+// Splits each element into its bytes, byte n of every element goes to
+// plane n.  With delta each element is first replaced by its
+// difference to the previous element.
+//---------------------------------------------------------------------
+template <typename T, bool delta>
+static void ShuffleElements(const uint8_t* source, int64_t count, uint8_t* destination)
+{
+    T previous = 0;
+    for (int64_t x = 0; x < count; ++x)
+    {
+        T value;
+        memcpy(&value, source + x * sizeof(T), sizeof(T));
+        auto element = delta ? static_cast<T>(value - previous) : value;
+        previous = value;
+        for (size_t b = 0; b < sizeof(T); ++b)
+        {
+            destination[b * count + x] = static_cast<uint8_t>(element >> (8 * b));
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+template <typename T, bool delta>
+static void UnshuffleElements(const uint8_t* source, int64_t count, uint8_t* destination)
+{
+    T previous = 0;
+    for (int64_t x = 0; x < count; ++x)
+    {
+        T element = 0;
+        for (size_t b = 0; b < sizeof(T); ++b)
+        {
+            element |= static_cast<T>(static_cast<T>(source[b * count + x]) << (8 * b));
+        }
+        if (delta)
+        {
+            element = static_cast<T>(element + previous);
+            previous = element;
+        }
+        memcpy(destination + x * sizeof(T), &element, sizeof(T));
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+template <typename T>
+static void FilterElements(const uint8_t* source, int64_t count, uint8_t* destination, bool delta, bool reverse)
+{
+    if (reverse)
+    {
+        delta ? UnshuffleElements<T, true>(source, count, destination) : UnshuffleElements<T, false>(source, count, destination);
+    }
+    else
+    {
+        delta ? ShuffleElements<T, true>(source, count, destination) : ShuffleElements<T, false>(source, count, destination);
+    }
+}
+
+//---------------------------------------------------------------------
+// Bytes after the last whole element are copied as they are.
+//---------------------------------------------------------------------
+static void Filter(const uint8_t* source, int64_t byteCount, uint8_t* destination, int64_t elementSize, bool delta, bool reverse)
+{
+    auto count = byteCount / elementSize;
+    switch (elementSize)
+    {
+        case 1:
+            FilterElements<uint8_t>(source, count, destination, delta, reverse);
+            break;
+        case 2:
+            FilterElements<uint16_t>(source, count, destination, delta, reverse);
+            break;
+        case 4:
+            FilterElements<uint32_t>(source, count, destination, delta, reverse);
+            break;
+        case 8:
+            FilterElements<uint64_t>(source, count, destination, delta, reverse);
+            break;
+    }
+    memcpy(destination + count * elementSize, source + count * elementSize, byteCount - count * elementSize);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static bool IsValidElementSize(int64_t elementSize)
+{
+    return elementSize == 1 || elementSize == 2 || elementSize == 4 || elementSize == 8;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SidebandCompression::SidebandCompression() :
+    _mode(CompressionOff),
+    _elementSize(DefaultElementSize),
+    _linkBytesPerSecond(DefaultLinkBytesPerSecond),
+    _skipFrames(0),
+    _windowFrames(0),
+    _windowRawBytes(0),
+    _windowPayloadBytes(0),
+    _windowNanoseconds(0),
+    _rawBytes(0),
+    _wireBytes(0),
+    _nanoseconds(0)
+{
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SidebandCompression::SetMode(int64_t mode)
+{
+    if (mode < CompressionOff || mode > CompressionDeltaShuffle)
+    {
+        return false;
+    }
+    _mode = mode;
+    _skipFrames = 0;
+    _windowFrames = _windowRawBytes = _windowPayloadBytes = _windowNanoseconds = 0;
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SidebandCompression::SetElementSize(int64_t elementSize)
+{
+    if (!IsValidElementSize(elementSize))
+    {
+        return false;
+    }
+    _elementSize = elementSize;
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void SidebandCompression::SetLinkBytesPerSecond(int64_t linkBytesPerSecond)
+{
+    _linkBytesPerSecond = linkBytesPerSecond > 0 ? linkBytesPerSecond : DefaultLinkBytesPerSecond;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SidebandCompression::Mode()
+{
+    return _mode;
+}
+
+//---------------------------------------------------------------------
+// The mode frames are written with right now, CompressionOff while
+// compression is turned off because it did not pay.
+//---------------------------------------------------------------------
+int64_t SidebandCompression::ActiveMode()
+{
+    return _skipFrames > 0 ? CompressionOff : _mode;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SidebandCompression::ElementSize()
+{
+    return _elementSize;
+}
+
+//---------------------------------------------------------------------
+// Returns the size of the compressed payload, or 0 if the frame should
+// be sent as it is.
+//---------------------------------------------------------------------
+int64_t SidebandCompression::Compress(const uint8_t* bytes, int64_t byteCount)
+{
+    if (_mode == CompressionOff)
+    {
+        return 0;
+    }
+    _rawBytes += byteCount;
+    if (byteCount < MinimumCompressedBytes || _skipFrames > 0)
+    {
+        _skipFrames -= _skipFrames > 0 ? 1 : 0;
+        _wireBytes += byteCount;
+        return 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto source = bytes;
+    if (_mode != CompressionLz)
+    {
+        _filtered.resize(byteCount);
+        Filter(bytes, byteCount, _filtered.data(), _elementSize, _mode == CompressionDeltaShuffle, false);
+        source = _filtered.data();
+    }
+    _payload.resize(CompressionHeaderSize + LzCompressBound(byteCount));
+    auto compressedSize = LzCompress(source, byteCount, _payload.data() + CompressionHeaderSize, _payload.size() - CompressionHeaderSize);
+    auto payloadSize = compressedSize + CompressionHeaderSize;
+    if (compressedSize == 0 || payloadSize >= byteCount)
+    {
+        payloadSize = 0;
+    }
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    _nanoseconds += nanoseconds;
+    _wireBytes += payloadSize != 0 ? payloadSize : byteCount;
+    _windowFrames += 1;
+    _windowRawBytes += byteCount;
+    _windowPayloadBytes += payloadSize != 0 ? payloadSize : byteCount;
+    _windowNanoseconds += nanoseconds;
+    Evaluate();
+    if (payloadSize == 0)
+    {
+        return 0;
+    }
+    memset(_payload.data(), 0, CompressionHeaderSize);
+    memcpy(_payload.data(), &byteCount, sizeof(int64_t));
+    _payload[8] = static_cast<uint8_t>(_mode);
+    _payload[9] = static_cast<uint8_t>(_elementSize);
+    return payloadSize;
+}
+
+//---------------------------------------------------------------------
+// Compression pays when it saves more time on the link than it costs,
+// the link speed comes from SOCKET_LINK_BYTES_PER_SECOND.
+//---------------------------------------------------------------------
+void SidebandCompression::Evaluate()
+{
+    if (_windowFrames < EvaluationFrames)
+    {
+        return;
+    }
+    auto savedBytes = _windowRawBytes - _windowPayloadBytes;
+    auto savedNanoseconds = static_cast<double>(savedBytes) * 1e9 / static_cast<double>(_linkBytesPerSecond);
+    if (_windowPayloadBytes * 100 > _windowRawBytes * MaxUsefulPercent || static_cast<double>(_windowNanoseconds) > savedNanoseconds)
+    {
+        _skipFrames = RetryFrames;
+    }
+    _windowFrames = _windowRawBytes = _windowPayloadBytes = _windowNanoseconds = 0;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* SidebandCompression::Payload()
+{
+    return _payload.data();
+}
+
+//---------------------------------------------------------------------
+// Buffer to receive a compressed payload into before Decompress.
+//---------------------------------------------------------------------
+uint8_t* SidebandCompression::PayloadBuffer(int64_t payloadSize)
+{
+    if (static_cast<int64_t>(_payload.size()) < payloadSize)
+    {
+        _payload.resize(payloadSize);
+    }
+    return _payload.data();
+}
+
+//---------------------------------------------------------------------
+// Decompresses the payload received into PayloadBuffer.  The data stays
+// valid until the next call.  Frames that would decompress to more than
+// maxByteCount are rejected, the size comes from the peer.
+//---------------------------------------------------------------------
+const uint8_t* SidebandCompression::Decompress(int64_t payloadSize, int64_t maxByteCount, int64_t* byteCount)
+{
+    if (payloadSize < CompressionHeaderSize || static_cast<int64_t>(_payload.size()) < payloadSize)
+    {
+        return nullptr;
+    }
+    int64_t decompressedCount = 0;
+    memcpy(&decompressedCount, _payload.data(), sizeof(int64_t));
+    int64_t mode = _payload[8];
+    int64_t elementSize = _payload[9];
+    auto compressedSize = payloadSize - CompressionHeaderSize;
+    if (mode < CompressionLz || mode > CompressionDeltaShuffle || !IsValidElementSize(elementSize) ||
+        decompressedCount < 0 || decompressedCount > maxByteCount || decompressedCount > compressedSize * 255 + 16)
+    {
+        return nullptr;
+    }
+    auto start = std::chrono::steady_clock::now();
+    _decompressed.resize(decompressedCount);
+    auto compressed = _payload.data() + CompressionHeaderSize;
+    if (mode == CompressionLz)
+    {
+        if (!LzDecompress(compressed, compressedSize, _decompressed.data(), decompressedCount))
+        {
+            return nullptr;
+        }
+    }
+    else
+    {
+        _filtered.resize(decompressedCount);
+        if (!LzDecompress(compressed, compressedSize, _filtered.data(), decompressedCount))
+        {
+            return nullptr;
+        }
+        Filter(_filtered.data(), decompressedCount, _decompressed.data(), elementSize, mode == CompressionDeltaShuffle, true);
+    }
+    _nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    _rawBytes += decompressedCount;
+    _wireBytes += payloadSize;
+    *byteCount = decompressedCount;
+    return _decompressed.data();
+}
+
+//---------------------------------------------------------------------
+// Bytes before compression.
+//---------------------------------------------------------------------
+int64_t SidebandCompression::RawBytes()
+{
+    return _rawBytes;
+}
+
+//---------------------------------------------------------------------
+// Bytes on the wire.
+//---------------------------------------------------------------------
+int64_t SidebandCompression::WireBytes()
+{
+    return _wireBytes;
+}
+
+//---------------------------------------------------------------------
+// Time spent compressing and decompressing.
+//---------------------------------------------------------------------
+int64_t SidebandCompression::Microseconds()
+{
+    return _nanoseconds / 1000;
+}
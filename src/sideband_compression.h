@@ -0,0 +1,77 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#pragma once
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <cstdint>
+#include <vector>
+
+//---------------------------------------------------------------------
+// Compression modes of SOCKET_COMPRESSION.  The shuffle filter groups
+// byte n of every element together before compressing, the delta filter
+// first replaces each element with its difference to the previous one.
+// Both work on little endian elements of SOCKET_COMPRESSION_ELEMENT_SIZE
+// bytes.
+//---------------------------------------------------------------------
+static const int64_t CompressionOff = 0;
+static const int64_t CompressionLz = 1;
+static const int64_t CompressionShuffle = 2;
+static const int64_t CompressionDeltaShuffle = 3;
+
+//---------------------------------------------------------------------
+// LZ4 style block codec: runs of literals followed by matches with a
+// 16 bit offset into the last 64KB of the block.
+//---------------------------------------------------------------------
+int64_t LzCompressBound(int64_t byteCount);
+int64_t LzCompress(const uint8_t* source, int64_t byteCount, uint8_t* destination, int64_t capacity);
+bool LzDecompress(const uint8_t* source, int64_t byteCount, uint8_t* destination, int64_t decompressedCount);
+
+//---------------------------------------------------------------------
+// Compresses the frames of one direction of a sideband, or decompresses
+// them, and keeps the statistics for it.  Compressed frames carry a header with the mode
+// and element size so the reader needs no configuration.  The writer
+// turns compression off for a while when a window of frames shows it
+// does not pay: the frames shrink by less than 10%, or compressing
+// takes longer than the link needs for the bytes it saves.
+//---------------------------------------------------------------------
+class SidebandCompression
+{
+public:
+    SidebandCompression();
+
+    bool SetMode(int64_t mode);
+    bool SetElementSize(int64_t elementSize);
+    void SetLinkBytesPerSecond(int64_t linkBytesPerSecond);
+    int64_t Mode();
+    int64_t ActiveMode();
+    int64_t ElementSize();
+
+    int64_t Compress(const uint8_t* bytes, int64_t byteCount);
+    const uint8_t* Payload();
+    uint8_t* PayloadBuffer(int64_t payloadSize);
+    const uint8_t* Decompress(int64_t payloadSize, int64_t maxByteCount, int64_t* byteCount);
+
+    int64_t RawBytes();
+    int64_t WireBytes();
+    int64_t Microseconds();
+
+private:
+    void Evaluate();
+
+private:
+    int64_t _mode;
+    int64_t _elementSize;
+    int64_t _linkBytesPerSecond;
+    int64_t _skipFrames;
+    int64_t _windowFrames;
+    int64_t _windowRawBytes;
+    int64_t _windowPayloadBytes;
+    int64_t _windowNanoseconds;
+    int64_t _rawBytes;
+    int64_t _wireBytes;
+    int64_t _nanoseconds;
+    std::vector<uint8_t> _filtered;
+    std::vector<uint8_t> _payload;
+    std::vector<uint8_t> _decompressed;
+};
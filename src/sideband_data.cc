@@ -5,6 +5,9 @@
 #include <iostream>
 #include <atomic>
 #include <cstring>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "sideband_data.h"
 #include "sideband_internal.h"
 
@@ -14,28 +17,108 @@ std::mutex _bufferLockMutex;
 std::condition_variable _bufferLock;
 std::map<std::string, SidebandData*> _buffers;
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+std::mutex _defaultPropertiesMutex;
+std::map<::SidebandProperty, int64_t> _defaultProperties;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t DefaultSpinMicroseconds = 20;
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 SidebandData::SidebandData(int64_t bufferSize) :
-    _bufferSize(bufferSize)
+    _bufferSize(bufferSize),
+    _serializeBuffer(nullptr)
 {
+    _waitPolicy = static_cast<::SidebandWaitPolicy>(GetSidebandDefaultProperty(::SidebandProperty::WAIT_POLICY, static_cast<int64_t>(::SidebandWaitPolicy::DEFAULT)));
+    _spinMicroseconds = GetSidebandDefaultProperty(::SidebandProperty::WAIT_SPIN_MICROSECONDS, DefaultSpinMicroseconds);
+    _waitTimeoutMilliseconds = GetSidebandDefaultProperty(::SidebandProperty::SHARED_MEMORY_WAIT_TIMEOUT_MILLISECONDS, -1);
+    GetSidebandNumaPlacement(&_numaPolicy, &_numaNode);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 SidebandData::~SidebandData()
 {
+    FreeNumaBuffer(_serializeBuffer, _bufferSize);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 uint8_t* SidebandData::SerializeBuffer()
 {
-    if (_serializeBuffer.size() == 0)
+    if (_serializeBuffer == nullptr)
     {
-        _serializeBuffer = std::vector<uint8_t>(_bufferSize);
+        _serializeBuffer = AllocateNumaBuffer(_bufferSize, _numaPolicy, _numaNode);
     }
-    return _serializeBuffer.data();
+    return _serializeBuffer;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SidebandData::SetProperty(::SidebandProperty property, int64_t value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::WAIT_POLICY:
+            if (value < static_cast<int64_t>(::SidebandWaitPolicy::DEFAULT) || value > static_cast<int64_t>(::SidebandWaitPolicy::BLOCK))
+            {
+                return false;
+            }
+            _waitPolicy = static_cast<::SidebandWaitPolicy>(value);
+            return true;
+        case ::SidebandProperty::WAIT_SPIN_MICROSECONDS:
+            if (value < 0)
+            {
+                return false;
+            }
+            _spinMicroseconds = value;
+            return true;
+        case ::SidebandProperty::SHARED_MEMORY_WAIT_TIMEOUT_MILLISECONDS:
+            _waitTimeoutMilliseconds = value;
+            return true;
+    }
+    return false;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::WAIT_POLICY:
+            *value = static_cast<int64_t>(_waitPolicy);
+            return true;
+        case ::SidebandProperty::WAIT_SPIN_MICROSECONDS:
+            *value = _spinMicroseconds;
+            return true;
+        case ::SidebandProperty::SHARED_MEMORY_WAIT_TIMEOUT_MILLISECONDS:
+            *value = _waitTimeoutMilliseconds;
+            return true;
+        case ::SidebandProperty::NUMA_POLICY:
+            *value = static_cast<int64_t>(_numaPolicy);
+            return true;
+        case ::SidebandProperty::NUMA_NODE:
+            *value = _serializeBuffer != nullptr ? NumaNodeOfAddress(_serializeBuffer) : _numaNode;
+            return true;
+    }
+    return false;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t GetSidebandDefaultProperty(::SidebandProperty property, int64_t defaultValue)
+{
+    std::unique_lock<std::mutex> lock(_defaultPropertiesMutex);
+    auto it = _defaultProperties.find(property);
+    if (it == _defaultProperties.end())
+    {
+        return defaultValue;
+    }
+    return it->second;
 }
 
 
@@ -59,6 +142,23 @@ std::string NextConnectionId()
     return buffer;
 }
 
+//---------------------------------------------------------------------
+// Shared memory ids include the process id so that regions created by
+// different processes on the same machine never collide.
+//---------------------------------------------------------------------
+std::string NextSharedMemoryId()
+{
+    char buffer[32];
+    auto id = ++_nextId;
+#ifdef _WIN32
+    auto processId = static_cast<int>(GetCurrentProcessId());
+#else
+    auto processId = static_cast<int>(getpid());
+#endif
+    sprintf(buffer, "SHM_%d_%d", processId, id);
+    return buffer;
+}
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 int32_t _SIDEBAND_FUNC SidebandData_Write(int64_t sidebandToken, const uint8_t* bytes, int64_t byteCount)
@@ -167,6 +267,35 @@ int32_t _SIDEBAND_FUNC SidebandData_SerializeBuffer(int64_t sidebandToken, uint8
     return 0;
 }
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC SidebandData_SetProperty(int64_t sidebandToken, ::SidebandProperty property, int64_t value)
+{
+    auto sidebandData = reinterpret_cast<SidebandData*>(sidebandToken);
+    auto result = sidebandData->SetProperty(property, value);
+    return result ? 0 : -1;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC SidebandData_GetProperty(int64_t sidebandToken, ::SidebandProperty property, int64_t* value)
+{
+    auto sidebandData = reinterpret_cast<SidebandData*>(sidebandToken);
+    auto result = sidebandData->GetProperty(property, value);
+    return result ? 0 : -1;
+}
+
+//---------------------------------------------------------------------
+// Returns a file descriptor that becomes readable when the peer
+// publishes, for use with poll or epoll.
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC SidebandData_GetDoorbell(int64_t sidebandToken, int32_t* out_fd)
+{
+    auto sidebandData = reinterpret_cast<SidebandData*>(sidebandToken);
+    *out_fd = sidebandData->GetDoorbell();
+    return *out_fd != -1 ? 0 : -1;
+}
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 int32_t _SIDEBAND_FUNC QueueSidebandConnection(::SidebandStrategy strategy, const char* id, bool waitForReader, bool waitForWriter, int64_t bufferSize)
@@ -181,6 +310,9 @@ int32_t _SIDEBAND_FUNC QueueSidebandConnection(::SidebandStrategy strategy, cons
 #endif
     case ::SidebandStrategy::SOCKETS:
     case ::SidebandStrategy::SOCKETS_LOW_LATENCY:
+    case ::SidebandStrategy::UNIX_SOCKETS:
+    case ::SidebandStrategy::SOCKETS_STRIPED:
+    case ::SidebandStrategy::HYPERVISOR_SOCKETS:
         SocketSidebandData::QueueSidebandConnection(strategy, id, bufferSize);
     default:
         // don't need to queue for non RDMA strategies
@@ -199,6 +331,10 @@ int32_t _SIDEBAND_FUNC InitOwnerSidebandData(::SidebandStrategy strategy, int64_
         case ::SidebandStrategy::DOUBLE_BUFFERED_SHARED_MEMORY:
             {
                 auto sidebandData = DoubleBufferedSharedMemorySidebandData::InitNew(bufferSize);
+                if (sidebandData == nullptr)
+                {
+                    return -1;
+                }
                 _buffers.emplace(sidebandData->UsageId(), sidebandData);
                 strcpy(out_sideband_id, sidebandData->UsageId().c_str());
                 return 0;
@@ -207,6 +343,46 @@ int32_t _SIDEBAND_FUNC InitOwnerSidebandData(::SidebandStrategy strategy, int64_
         case ::SidebandStrategy::SHARED_MEMORY:
             {
                 auto sidebandData = SharedMemorySidebandData::InitNew(bufferSize);
+                if (sidebandData == nullptr)
+                {
+                    return -1;
+                }
+                _buffers.emplace(sidebandData->UsageId(), sidebandData);
+                strcpy(out_sideband_id, sidebandData->UsageId().c_str());
+                return 0;
+            }
+            break;
+        case ::SidebandStrategy::RING_BUFFER_SHARED_MEMORY:
+            {
+                auto sidebandData = RingBufferSharedMemorySidebandData::InitNew(bufferSize);
+                if (sidebandData == nullptr)
+                {
+                    return -1;
+                }
+                _buffers.emplace(sidebandData->UsageId(), sidebandData);
+                strcpy(out_sideband_id, sidebandData->UsageId().c_str());
+                return 0;
+            }
+            break;
+        case ::SidebandStrategy::LATEST_VALUE_SHARED_MEMORY:
+            {
+                auto sidebandData = MailboxSharedMemorySidebandData::InitNew(bufferSize);
+                if (sidebandData == nullptr)
+                {
+                    return -1;
+                }
+                _buffers.emplace(sidebandData->UsageId(), sidebandData);
+                strcpy(out_sideband_id, sidebandData->UsageId().c_str());
+                return 0;
+            }
+            break;
+        case ::SidebandStrategy::BROADCAST_SHARED_MEMORY:
+            {
+                auto sidebandData = BroadcastSharedMemorySidebandData::InitNew(bufferSize);
+                if (sidebandData == nullptr)
+                {
+                    return -1;
+                }
                 _buffers.emplace(sidebandData->UsageId(), sidebandData);
                 strcpy(out_sideband_id, sidebandData->UsageId().c_str());
                 return 0;
@@ -214,6 +390,9 @@ int32_t _SIDEBAND_FUNC InitOwnerSidebandData(::SidebandStrategy strategy, int64_
             break;
         case ::SidebandStrategy::SOCKETS:
         case ::SidebandStrategy::SOCKETS_LOW_LATENCY:
+        case ::SidebandStrategy::UNIX_SOCKETS:
+        case ::SidebandStrategy::SOCKETS_STRIPED:
+        case ::SidebandStrategy::HYPERVISOR_SOCKETS:
             strcpy(out_sideband_id, NextConnectionId().c_str());
             return 0;
 #ifdef ENABLE_RDMA_SIDEBAND
@@ -247,15 +426,33 @@ int32_t _SIDEBAND_FUNC InitClientSidebandData(const char* sidebandServiceUrl, ::
     switch (strategy)
     {
         case ::SidebandStrategy::SHARED_MEMORY:
-            sidebandData = new SharedMemorySidebandData(usageId, bufferSize);
+            sidebandData = SharedMemorySidebandData::ClientInit(usageId, bufferSize, sidebandServiceUrl);
             break;
         case ::SidebandStrategy::DOUBLE_BUFFERED_SHARED_MEMORY:
-            sidebandData = new DoubleBufferedSharedMemorySidebandData(usageId, bufferSize);
+            sidebandData = DoubleBufferedSharedMemorySidebandData::ClientInit(usageId, bufferSize, sidebandServiceUrl);
+            break;
+        case ::SidebandStrategy::RING_BUFFER_SHARED_MEMORY:
+            sidebandData = RingBufferSharedMemorySidebandData::ClientInit(usageId, bufferSize, sidebandServiceUrl);
+            break;
+        case ::SidebandStrategy::LATEST_VALUE_SHARED_MEMORY:
+            sidebandData = MailboxSharedMemorySidebandData::ClientInit(usageId, bufferSize, sidebandServiceUrl);
+            break;
+        case ::SidebandStrategy::BROADCAST_SHARED_MEMORY:
+            sidebandData = BroadcastSharedMemorySidebandData::ClientInit(usageId, bufferSize, sidebandServiceUrl);
             break;
         case ::SidebandStrategy::SOCKETS:
         case ::SidebandStrategy::SOCKETS_LOW_LATENCY:
             sidebandData = SocketSidebandData::ClientInit(sidebandServiceUrl, usageId, bufferSize, strategy == ::SidebandStrategy::SOCKETS_LOW_LATENCY);
             break;
+        case ::SidebandStrategy::UNIX_SOCKETS:
+            sidebandData = SocketSidebandData::UnixClientInit(sidebandServiceUrl, usageId, bufferSize);
+            break;
+        case ::SidebandStrategy::SOCKETS_STRIPED:
+            sidebandData = SocketSidebandData::StripedClientInit(sidebandServiceUrl, usageId, bufferSize);
+            break;
+        case ::SidebandStrategy::HYPERVISOR_SOCKETS:
+            sidebandData = SocketSidebandData::HypervisorClientInit(sidebandServiceUrl, usageId, bufferSize);
+            break;
 #ifdef ENABLE_RDMA_SIDEBAND
         case ::SidebandStrategy::RDMA:
             sidebandData = RdmaSidebandData::ClientInit(sidebandServiceUrl, false, usageId, bufferSize);
@@ -267,6 +464,10 @@ int32_t _SIDEBAND_FUNC InitClientSidebandData(const char* sidebandServiceUrl, ::
             break;
 #endif
     }
+    if (sidebandData == nullptr)
+    {
+        return -1;
+    }
     if (insert)
     {
         std::unique_lock<std::mutex> lock(_bufferLockMutex);
@@ -278,6 +479,15 @@ int32_t _SIDEBAND_FUNC InitClientSidebandData(const char* sidebandServiceUrl, ::
     return 0;
 }
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC SetSidebandDefaultProperty(::SidebandProperty property, int64_t value)
+{
+    std::unique_lock<std::mutex> lock(_defaultPropertiesMutex);
+    _defaultProperties[property] = value;
+    return 0;
+}
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 void RegisterSidebandData(SidebandData* sidebandData)
@@ -326,18 +536,33 @@ int32_t _SIDEBAND_FUNC CloseSidebandData(int64_t dataToken)
 std::string GetConnectionAddress(::SidebandStrategy strategy)
 {
     std::string address;
+    if (strategy == ::SidebandStrategy::SHARED_MEMORY ||
+        strategy == ::SidebandStrategy::DOUBLE_BUFFERED_SHARED_MEMORY ||
+        strategy == ::SidebandStrategy::RING_BUFFER_SHARED_MEMORY ||
+        strategy == ::SidebandStrategy::LATEST_VALUE_SHARED_MEMORY ||
+        strategy == ::SidebandStrategy::BROADCAST_SHARED_MEMORY)
+    {
+        address = GetSharedMemoryAddress();
+    }
     #ifdef ENABLE_RDMA_SIDEBAND
-        if (strategy == ::SidebandStrategy::RDMA ||
+        else if (strategy == ::SidebandStrategy::RDMA ||
             strategy == ::SidebandStrategy::RDMA_LOW_LATENCY)
         {
-            address = GetRdmaAddress() + ":50060";
+            address = GetRdmaConnectionAddress();
         }
-        {
-            address = GetSocketsAddress() + ":" + GetSocketsPort();
-        }
-    #else
-        address = GetSocketsAddress() + ":" + GetSocketsPort();
     #endif
+    else if (strategy == ::SidebandStrategy::UNIX_SOCKETS)
+    {
+        address = GetUnixSocketsPath();
+    }
+    else if (strategy == ::SidebandStrategy::HYPERVISOR_SOCKETS)
+    {
+        address = GetHypervisorSocketsAddress();
+    }
+    else
+    {
+        address = GetSocketsAddress() + ":" + GetSocketsPort();
+    }
     std::cout << "Connection address: " << address << std::endl;
     return address;
 }
@@ -38,7 +38,75 @@ enum class SidebandStrategy
   SOCKETS_LOW_LATENCY = 5,
   HYPERVISOR_SOCKETS = 6,
   RDMA = 7,
-  RDMA_LOW_LATENCY = 8
+  RDMA_LOW_LATENCY = 8,
+  RING_BUFFER_SHARED_MEMORY = 9,
+  LATEST_VALUE_SHARED_MEMORY = 10,
+  BROADCAST_SHARED_MEMORY = 11,
+  UNIX_SOCKETS = 12,
+  SOCKETS_STRIPED = 13
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+enum class SidebandWaitPolicy
+{
+  DEFAULT = 0,
+  SPIN = 1,
+  SPIN_THEN_BLOCK = 2,
+  BLOCK = 3
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+enum class SidebandNumaPolicy
+{
+  DEFAULT = 0,
+  LOCAL = 1,
+  NODE = 2,
+  INTERLEAVE = 3
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+enum class SidebandProperty
+{
+  WAIT_POLICY = 1,
+  WAIT_SPIN_MICROSECONDS = 2,
+  SHARED_MEMORY_PAGE_SIZE = 3,
+  SHARED_MEMORY_PREFAULT = 4,
+  SHARED_MEMORY_LOCK = 5,
+  SHARED_MEMORY_BUFFER_COUNT = 6,
+  LATEST_VALUE_SEQUENCE = 7,
+  BROADCAST_DROP_LAGGARDS = 8,
+  BROADCAST_DROPPED = 9,
+  NUMA_POLICY = 10,
+  NUMA_NODE = 11,
+  SOCKET_SEND_CALLS = 12,
+  SOCKET_RECEIVE_CALLS = 13,
+  SOCKET_ZEROCOPY_THRESHOLD = 14,
+  SOCKET_ZEROCOPY_SENDS = 15,
+  SOCKET_ZEROCOPY_COPIED = 16,
+  SOCKET_ACCEPT_BACKLOG = 17,
+  SOCKET_ACCEPT_THREADS = 18,
+  SOCKET_HANDSHAKE_TIMEOUT_MILLISECONDS = 19,
+  SOCKET_IO_URING = 20,
+  SOCKET_BUSY_POLL_MICROSECONDS = 21,
+  SOCKET_QUICK_ACK = 22,
+  SOCKET_SEND_BUFFER_SIZE = 23,
+  SOCKET_RECEIVE_BUFFER_SIZE = 24,
+  SOCKET_LINK_BYTES_PER_SECOND = 25,
+  SOCKET_NOTSENT_LOWAT = 26,
+  SOCKET_ROUND_TRIP_MICROSECONDS = 27,
+  SOCKET_STRIPES = 28,
+  SOCKET_STRIPE_FIRST_CPU = 29,
+  SOCKET_READ_AHEAD_BYTES = 30,
+  SOCKET_COMPRESSION = 31,
+  SOCKET_COMPRESSION_ELEMENT_SIZE = 32,
+  SOCKET_COMPRESSION_RATIO_PERCENT = 33,
+  SOCKET_COMPRESSION_MICROSECONDS = 34,
+  SOCKET_CONNECT_TIMEOUT_MILLISECONDS = 35,
+  RDMA_PIPELINE_DEPTH = 36,
+  SHARED_MEMORY_WAIT_TIMEOUT_MILLISECONDS = 37
 };
 
 //---------------------------------------------------------------------
@@ -46,6 +114,7 @@ enum class SidebandStrategy
 int32_t _SIDEBAND_FUNC InitOwnerSidebandData(::SidebandStrategy strategy, int64_t bufferSize, char* out_sideband_id);
 int32_t _SIDEBAND_FUNC GetOwnerSidebandDataToken(const char* usageId, int64_t* out_tokenId);
 int32_t _SIDEBAND_FUNC InitClientSidebandData(const char* sidebandServiceUrl, ::SidebandStrategy strategy, const char* usageId, int bufferSize, int64_t* out_tokenId);
+int32_t _SIDEBAND_FUNC SetSidebandDefaultProperty(::SidebandProperty property, int64_t value);
 int32_t _SIDEBAND_FUNC WriteSidebandData(int64_t dataToken, uint8_t* bytes, int64_t bytecount);
 int32_t _SIDEBAND_FUNC ReadSidebandData(int64_t dataToken, uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead);
 int32_t _SIDEBAND_FUNC CloseSidebandData(int64_t dataToken);
@@ -53,6 +122,8 @@ int32_t _SIDEBAND_FUNC CloseSidebandData(int64_t dataToken);
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 int32_t _SIDEBAND_FUNC RunSidebandSocketsAccept(const char* address, int port, std::atomic<bool>& stop_flag);
+int32_t _SIDEBAND_FUNC RunSidebandUnixSocketsAccept(const char* path, std::atomic<bool>& stop_flag);
+int32_t _SIDEBAND_FUNC RunSidebandHypervisorSocketsAccept(int port, std::atomic<bool>& stop_flag);
 int32_t _SIDEBAND_FUNC AcceptSidebandRdmaSendRequests();
 int32_t _SIDEBAND_FUNC AcceptSidebandRdmaReceiveRequests();
 int32_t _SIDEBAND_FUNC GetSidebandConnectionAddress(::SidebandStrategy strategy, char address[1024]);
@@ -71,6 +142,9 @@ int32_t _SIDEBAND_FUNC SidebandData_FinishDirectRead(int64_t sidebandToken);
 int32_t _SIDEBAND_FUNC SidebandData_BeginDirectWrite(int64_t sidebandToken, uint8_t** buffer);
 int32_t _SIDEBAND_FUNC SidebandData_FinishDirectWrite(int64_t sidebandToken, int64_t byteCount);
 int32_t _SIDEBAND_FUNC SidebandData_SerializeBuffer(int64_t sidebandToken, uint8_t** buffer);
+int32_t _SIDEBAND_FUNC SidebandData_SetProperty(int64_t sidebandToken, ::SidebandProperty property, int64_t value);
+int32_t _SIDEBAND_FUNC SidebandData_GetProperty(int64_t sidebandToken, ::SidebandProperty property, int64_t* value);
+int32_t _SIDEBAND_FUNC SidebandData_GetDoorbell(int64_t sidebandToken, int32_t* out_fd);
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
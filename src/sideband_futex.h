@@ -0,0 +1,204 @@
+#pragma once
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <sideband_data.h>
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+    #include <intrin.h>
+#elif defined(__linux__)
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+    #include <sched.h>
+#else
+    #include <sched.h>
+#endif
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t CacheLineSize = 64;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+inline void SidebandCpuPause()
+{
+#if defined(_WIN32)
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+//---------------------------------------------------------------------
+// Spins on the condition according to the wait policy.  Returns true if
+// the condition became ready, false if the caller should block.
+//---------------------------------------------------------------------
+template <typename Condition>
+inline bool SpinForCondition(Condition ready, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    if (policy == ::SidebandWaitPolicy::BLOCK)
+    {
+        return ready();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t x = 1; ; ++x)
+    {
+        if (ready())
+        {
+            return true;
+        }
+        SidebandCpuPause();
+        if (policy != ::SidebandWaitPolicy::SPIN && (x % 64) == 0)
+        {
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            if (elapsed.count() >= spinMicroseconds)
+            {
+                return false;
+            }
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const long MaxFutexSignalWakes = 64;
+
+//---------------------------------------------------------------------
+// Process local half of a FutexSignal.  On Windows waiters block on a
+// named semaphore that both processes open by the same name, the other
+// platforms do not need anything per process.
+//---------------------------------------------------------------------
+class FutexSignalEvent
+{
+public:
+    FutexSignalEvent()
+    {
+#if defined(_WIN32)
+        _semaphore = NULL;
+#endif
+    }
+
+    ~FutexSignalEvent()
+    {
+#if defined(_WIN32)
+        if (_semaphore != NULL)
+        {
+            CloseHandle(_semaphore);
+        }
+#endif
+    }
+
+    inline void Open(const std::string& name)
+    {
+#if defined(_WIN32)
+        _semaphore = CreateSemaphoreA(NULL, 0, MaxFutexSignalWakes, name.c_str());
+        if (_semaphore == NULL)
+        {
+            std::cout << "Could not create the shared memory signal " << name << " " << GetLastError() << std::endl;
+        }
+#endif
+    }
+
+#if defined(_WIN32)
+    HANDLE _semaphore;
+#endif
+};
+
+//---------------------------------------------------------------------
+// Wake-up primitive that lives inside a shared memory mapping and works
+// across processes.  The notifier bumps the sequence after publishing
+// its state change and only enters the kernel when a waiter has
+// announced itself.  On Linux waiters block on a shared (non private)
+// futex, on Windows on the named semaphore of the event and elsewhere
+// they sleep briefly between checks.  Waits give up when the closed
+// word of the shared header is set or the timeout runs out, a negative
+// timeout waits until the condition is ready or the sideband is closed.
+//---------------------------------------------------------------------
+struct FutexSignal
+{
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> waiters;
+
+    inline void Notify(FutexSignalEvent& event)
+    {
+        sequence.fetch_add(1);
+        auto count = waiters.load();
+        if (count != 0)
+        {
+#if defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+            // A full semaphore already wakes every waiter
+            for (uint32_t x = 0; x < count && event._semaphore != NULL; ++x)
+            {
+                if (!ReleaseSemaphore(event._semaphore, 1, NULL))
+                {
+                    break;
+                }
+            }
+#endif
+        }
+    }
+
+    template <typename Condition>
+    inline bool Wait(Condition ready, const std::atomic<uint32_t>& closed, FutexSignalEvent& event, ::SidebandWaitPolicy policy, int64_t spinMicroseconds, int64_t timeoutMilliseconds)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMilliseconds < 0 ? 0 : timeoutMilliseconds);
+        auto expired = [&]() {
+            return timeoutMilliseconds >= 0 && std::chrono::steady_clock::now() >= deadline;
+        };
+        if (SpinForCondition([&]() { return ready() || closed.load() != 0 || expired(); }, policy, spinMicroseconds) && ready())
+        {
+            return true;
+        }
+        while (true)
+        {
+            uint32_t current = sequence.load();
+            waiters.fetch_add(1);
+            if (ready())
+            {
+                waiters.fetch_sub(1);
+                return true;
+            }
+            int64_t remaining = -1;
+            if (timeoutMilliseconds >= 0)
+            {
+                remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            }
+            if (closed.load() != 0 || (timeoutMilliseconds >= 0 && remaining <= 0))
+            {
+                waiters.fetch_sub(1);
+                return false;
+            }
+#if defined(__linux__)
+            struct timespec timeout = { static_cast<time_t>(remaining / 1000), static_cast<long>((remaining % 1000) * 1000000) };
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAIT, current, remaining < 0 ? nullptr : &timeout, nullptr, 0);
+#elif defined(_WIN32)
+            if (event._semaphore != NULL)
+            {
+                WaitForSingleObject(event._semaphore, remaining < 0 ? INFINITE : static_cast<DWORD>(remaining));
+            }
+            else
+            {
+                Sleep(1);
+            }
+#else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+#endif
+            waiters.fetch_sub(1);
+        }
+    }
+};
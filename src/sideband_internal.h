@@ -12,7 +12,12 @@
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 #include "sideband_semaphore.h"
+#include "sideband_futex.h"
 #include <vector>
+#include <memory>
+#include <map>
+#include <thread>
+#include <chrono>
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
@@ -37,9 +42,82 @@ public:
 
     uint8_t* SerializeBuffer();
 
+    virtual bool SetProperty(::SidebandProperty property, int64_t value);
+    virtual bool GetProperty(::SidebandProperty property, int64_t* value);
+    virtual int GetDoorbell() { return -1; }
+
+protected:
+    ::SidebandWaitPolicy _waitPolicy;
+    int64_t _spinMicroseconds;
+    int64_t _waitTimeoutMilliseconds;
+    ::SidebandNumaPolicy _numaPolicy;
+    int64_t _numaNode;
+
 private:
     int64_t _bufferSize;
-    std::vector<uint8_t> _serializeBuffer;
+    uint8_t* _serializeBuffer;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+class SharedMemoryRegion
+{
+public:
+    SharedMemoryRegion(const std::string& id, int64_t size, bool isOwner, const std::string& connectionUrl);
+    ~SharedMemoryRegion();
+
+    uint8_t* GetBuffer();
+    uint8_t* MappedBuffer();
+    int64_t PageSize();
+    int64_t NumaNode();
+
+private:
+    void Init();
+#ifndef _WIN32
+    void CloseMemoryFile();
+#endif
+
+private:
+#ifdef _WIN32
+    HANDLE _mapFile;
+#else
+    int _mapFD;
+    std::string _fileName;
+    bool _namedRegion;
+#endif
+    uint8_t* _buffer;
+    bool _initFailed;
+    std::string _id;
+    bool _isOwner;
+    std::string _connectionUrl;
+    int64_t _size;
+    int64_t _mappedSize;
+    int64_t _pageSize;
+    ::SidebandNumaPolicy _numaPolicy;
+    int64_t _numaNode;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+class SharedMemoryDoorbell
+{
+public:
+    SharedMemoryDoorbell(const std::string& id, bool isOwner, const std::string& connectionUrl);
+    ~SharedMemoryDoorbell();
+
+    void Create();
+    void Ring();
+    int ReadFd();
+
+private:
+    bool OpenEventFds();
+
+private:
+    std::string _id;
+    bool _isOwner;
+    std::string _connectionUrl;
+    SharedMemoryRegion _flags;
+    int _eventFds[2];
 };
 
 //---------------------------------------------------------------------
@@ -47,7 +125,7 @@ private:
 class SharedMemorySidebandData : public SidebandData
 {
 public:
-    SharedMemorySidebandData(const std::string& id, int64_t bufferSize);
+    SharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl);
     virtual ~SharedMemorySidebandData();
 
     bool Write(const uint8_t* bytes, int64_t byteCount) override;
@@ -64,31 +142,36 @@ public:
     bool FinishDirectWrite(int64_t byteCount) override;
 
     const std::string& UsageId() override;
-    uint8_t* GetBuffer();
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
+    int GetDoorbell() override;
 
 public:
     static SharedMemorySidebandData* InitNew(int64_t bufferSize);
+    static SharedMemorySidebandData* ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl);
+
+private:
+    uint8_t* WriteArea();
+    uint8_t* ReadArea();
 
 private:
-    void Init();
-#ifdef _WIN32
-    HANDLE _mapFile;
-#else
-    int _mapFD;
-    std::string _fileName;
-#endif
-    uint8_t* _buffer;
-    std::string _id;
     std::string _usageId;
+    bool _isOwner;
     int64_t _bufferSize;
+    int64_t _areaSize;
+    SharedMemoryRegion _region;
+    SharedMemoryDoorbell _doorbell;
 };
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct BufferPoolHeader;
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 class DoubleBufferedSharedMemorySidebandData : public SidebandData
 {
 public:
-    DoubleBufferedSharedMemorySidebandData(const std::string& id, int64_t bufferSize);
+    DoubleBufferedSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl);
     virtual ~DoubleBufferedSharedMemorySidebandData();
 
     bool Write(const uint8_t* bytes, int64_t byteCount) override;
@@ -105,15 +188,232 @@ public:
     bool FinishDirectWrite(int64_t byteCount) override;
 
     const std::string& UsageId() override;
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
+    int GetDoorbell() override;
 
 public:
     static DoubleBufferedSharedMemorySidebandData* InitNew(int64_t bufferSize);
+    static DoubleBufferedSharedMemorySidebandData* ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl);
+
+private:
+    ::SidebandWaitPolicy WaitPolicy();
+    BufferPoolHeader* PoolHeader();
+    uint8_t* Slots();
+    uint8_t* AcquireWriteSlot();
+    void PublishWriteSlot(int64_t byteCount);
+    uint8_t* AcquireReadSlot();
+    void ReleaseReadSlot();
+
+private:
+    std::string _id;
+    bool _isOwner;
+    std::string _connectionUrl;
+    int64_t _bufferSize;
+    int64_t _slotSize;
+    int64_t _slotCount;
+    int64_t _writeSlot;
+    int64_t _readSlot;
+    SharedMemoryRegion _header;
+    std::unique_ptr<SharedMemoryRegion> _slots;
+    FutexSignalEvent _slotFreeEvents[2];
+    FutexSignalEvent _slotFilledEvents[2];
+    SharedMemoryDoorbell _doorbell;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct RingBufferHeader;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+class RingBufferSharedMemorySidebandData : public SidebandData
+{
+public:
+    RingBufferSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl);
+    virtual ~RingBufferSharedMemorySidebandData();
+
+    bool Write(const uint8_t* bytes, int64_t byteCount) override;
+    bool Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
+    bool WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount) override;
+    bool ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
+    int64_t ReadLengthPrefix() override;
+
+    bool SupportsDirectReadWrite() override { return true; }
+    const uint8_t* BeginDirectRead(int64_t byteCount) override;
+    const uint8_t* BeginDirectReadLengthPrefixed(int64_t* bufferSize) override;
+    bool FinishDirectRead() override;
+    uint8_t* BeginDirectWrite() override;
+    bool FinishDirectWrite(int64_t byteCount) override;
+
+    const std::string& UsageId() override;
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
+    int GetDoorbell() override;
+
+public:
+    static RingBufferSharedMemorySidebandData* InitNew(int64_t bufferSize);
+    static RingBufferSharedMemorySidebandData* ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl);
+
+private:
+    ::SidebandWaitPolicy WaitPolicy();
+    RingBufferHeader* RingHeader(int direction);
+    uint8_t* RingData(int direction);
+    uint8_t* ReserveWriteFrame(int64_t byteCount);
+    void PublishWriteFrame(int64_t byteCount);
+    uint8_t* AcquireReadFrame();
+    void ReleaseReadFrame();
 
 private:
     std::string _id;
-    SharedMemorySidebandData* _current;
-    SharedMemorySidebandData _bufferA;
-    SharedMemorySidebandData _bufferB;
+    bool _isOwner;
+    int64_t _bufferSize;
+    int64_t _ringSize;
+    SharedMemoryRegion _region;
+    uint8_t* _readFrame;
+    FutexSignalEvent _dataAvailableEvents[2];
+    FutexSignalEvent _spaceAvailableEvents[2];
+    SharedMemoryDoorbell _doorbell;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct MailboxHeader;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+class MailboxSharedMemorySidebandData : public SidebandData
+{
+public:
+    MailboxSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl);
+    virtual ~MailboxSharedMemorySidebandData();
+
+    bool Write(const uint8_t* bytes, int64_t byteCount) override;
+    bool Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
+    bool WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount) override;
+    bool ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
+    int64_t ReadLengthPrefix() override;
+
+    bool SupportsDirectReadWrite() override { return true; }
+    const uint8_t* BeginDirectRead(int64_t byteCount) override;
+    const uint8_t* BeginDirectReadLengthPrefixed(int64_t* bufferSize) override;
+    bool FinishDirectRead() override;
+    uint8_t* BeginDirectWrite() override;
+    bool FinishDirectWrite(int64_t byteCount) override;
+
+    const std::string& UsageId() override;
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
+    int GetDoorbell() override;
+
+public:
+    static MailboxSharedMemorySidebandData* InitNew(int64_t bufferSize);
+    static MailboxSharedMemorySidebandData* ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl);
+
+private:
+    ::SidebandWaitPolicy WaitPolicy();
+    MailboxHeader* MailboxHeaderFor(int direction);
+    uint8_t* MailboxFrame(int direction);
+    uint8_t* BeginPublish();
+    void FinishPublish(int64_t byteCount);
+    uint8_t* ReadSnapshot();
+
+private:
+    std::string _id;
+    bool _isOwner;
+    int64_t _bufferSize;
+    int64_t _frameSize;
+    SharedMemoryRegion _region;
+    std::vector<uint8_t> _snapshot;
+    uint64_t _lastReadSequence;
+    uint64_t _writeSequence;
+    FutexSignalEvent _publishedEvents[2];
+    SharedMemoryDoorbell _doorbell;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct BroadcastHeader;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+class BroadcastSharedMemorySidebandData : public SidebandData
+{
+public:
+    BroadcastSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl);
+    virtual ~BroadcastSharedMemorySidebandData();
+
+    bool Write(const uint8_t* bytes, int64_t byteCount) override;
+    bool Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
+    bool WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount) override;
+    bool ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
+    int64_t ReadLengthPrefix() override;
+
+    bool SupportsDirectReadWrite() override { return true; }
+    const uint8_t* BeginDirectRead(int64_t byteCount) override;
+    const uint8_t* BeginDirectReadLengthPrefixed(int64_t* bufferSize) override;
+    bool FinishDirectRead() override;
+    uint8_t* BeginDirectWrite() override;
+    bool FinishDirectWrite(int64_t byteCount) override;
+
+    const std::string& UsageId() override;
+    bool SetProperty(::SidebandProperty property, int64_t value) override;
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
+
+public:
+    static BroadcastSharedMemorySidebandData* InitNew(int64_t bufferSize);
+    static BroadcastSharedMemorySidebandData* ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl);
+
+private:
+    ::SidebandWaitPolicy WaitPolicy();
+    BroadcastHeader* Header();
+    uint8_t* RingData();
+    int64_t FrameLength(const uint8_t* frame);
+    bool RegisterReader();
+    bool ReclaimExitedReaders();
+    uint64_t ScanMinimumCursor(uint64_t head);
+    void DropLaggards(uint64_t head, uint64_t needed);
+    bool WaitForReaders(uint64_t head, uint64_t needed);
+    uint8_t* ReserveWriteFrame(int64_t byteCount);
+    void PublishWriteFrame(int64_t byteCount);
+    uint8_t* AcquireReadFrame();
+    bool ReleaseReadFrame();
+
+private:
+    std::string _id;
+    bool _isOwner;
+    int64_t _bufferSize;
+    int64_t _ringSize;
+    SharedMemoryRegion _region;
+    int _readerIndex;
+    uint64_t _minimumCursor;
+    uint64_t _readCursor;
+    uint8_t* _readFrame;
+    FutexSignalEvent _dataAvailableEvent;
+    FutexSignalEvent _spaceAvailableEvent;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct SocketBuffer
+{
+    char* data;
+    int64_t length;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+class SocketIoUring;
+class SocketStripe;
+class SidebandCompression;
+
+//---------------------------------------------------------------------
+// Settings of a queued sideband, kept until the client connects and
+// sends its id.
+//---------------------------------------------------------------------
+struct PendingSocketConnection
+{
+    int64_t bufferSize;
+    bool lowLatency;
+    int64_t stripes;
+    std::chrono::steady_clock::time_point deadline;
 };
 
 //---------------------------------------------------------------------
@@ -131,29 +431,129 @@ public:
     bool ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
     int64_t ReadLengthPrefix() override;
 
+    bool SupportsDirectReadWrite() override { return true; }
+    const uint8_t* BeginDirectRead(int64_t byteCount) override;
+    const uint8_t* BeginDirectReadLengthPrefixed(int64_t* bufferSize) override;
+    bool FinishDirectRead() override;
+    uint8_t* BeginDirectWrite() override;
+    bool FinishDirectWrite(int64_t byteCount) override;
+
     const std::string& UsageId() override;
+    bool SetProperty(::SidebandProperty property, int64_t value) override;
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
+    int GetDoorbell() override;
 
 public:
     static void QueueSidebandConnection(::SidebandStrategy strategy, const std::string& id, int64_t bufferSize);
-    static SocketSidebandData* InitFromConnection(int socket);
+    static SocketSidebandData* InitFromConnection(int socket, const std::string& connectionId);
     static SocketSidebandData* ClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize, bool lowLatency);
+    static SocketSidebandData* UnixClientInit(const std::string& path, const std::string& usageId, int64_t bufferSize);
+    static SocketSidebandData* HypervisorClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize);
+    static SocketSidebandData* StripedClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize);
 
 private:
-    void ReadConnectionId();
+    static std::string ReadConnectionId(int socket);
     void ConnectToSocket(std::string address, std::string port, std::string usageId, bool lowLatency);
+    void ConnectToUnixSocket(const std::string& path, const std::string& usageId);
+    void ConnectToHypervisorSocket(const std::string& cid, const std::string& port, const std::string& usageId);
+    void FinishClientConnect(const std::string& usageId);
+    void InitSocketType();
+    void ApplyLowLatencyOptions();
+    void ApplySocketBufferSizes();
+    bool SetSocketOption(int level, int option, int64_t value);
+    bool GetSocketOption(int level, int option, int64_t* value);
+    int64_t RoundTripMicroseconds();
     bool WriteToSocket(const void* buffer, int64_t numBytes);
+    bool WriteBuffersToSocket(SocketBuffer* buffers, int count);
+    int64_t SendBuffers(SocketBuffer* buffers, int count, bool zeroCopy);
     bool ReadFromSocket(void* buffer, int64_t numBytes);
+    int64_t ReceiveFromSocket(SocketBuffer* buffers, int count);
+    int64_t ReceiveBuffers(SocketBuffer* buffers, int count, bool wait);
+    uint8_t* ReceiveBuffer(int64_t byteCount);
+    void RearmQuickAck();
+    bool EnableZeroCopy();
+    bool ReadZeroCopyCompletions();
+    bool WaitForZeroCopy(int64_t sendCount);
+    bool EnableIoUring();
+    SidebandCompression* Compression();
+    SidebandCompression* Decompression();
+    bool WriteFrame(int64_t prefix, const uint8_t* bytes, int64_t byteCount);
+    int64_t ReadCompressedFrame(int64_t payloadSize);
+    bool AttachStripe(SocketSidebandData* connection);
+    bool IsStriped(int64_t byteCount);
+    bool TransferStriped(bool write, char* data, int64_t byteCount, SocketBuffer* prefix);
+    ::SidebandWaitPolicy SocketWaitPolicy();
+    void ApplyWaitPolicy();
 
 private:
     std::string _id;
     uint64_t _socket;
     bool _lowLatency;
+    bool _messageBoundaries;
+    bool _hypervisorSocket;
+    bool _quickAck;
+    std::vector<uint8_t> _record;
+    int64_t _recordOffset;
+    int64_t _recordLength;
+    int64_t _readAheadSize;
+    int64_t _sendCalls;
+    int64_t _receiveCalls;
+    int64_t _bufferSize;
+    int64_t _zeroCopyThreshold;
+    bool _zeroCopyEnabled;
+    int64_t _zeroCopySends;
+    int64_t _zeroCopyCompleted;
+    int64_t _zeroCopyCopied;
+    uint8_t* _sendBuffers[2];
+    int64_t _sendBufferSends[2];
+    int _sendBuffer;
+    uint8_t* _receiveBuffer;
+    int64_t _receiveBufferSize;
+    int64_t _ioUringMode;
+    std::unique_ptr<SocketIoUring> _ioUring;
+    std::unique_ptr<SidebandCompression> _compression;
+    std::unique_ptr<SidebandCompression> _decompression;
+    const uint8_t* _decompressed;
+    int64_t _decompressedLength;
+    int64_t _stripeCount;
+    std::vector<std::unique_ptr<SocketStripe>> _stripes;
+    std::mutex _stripeMutex;
+    std::condition_variable _stripesAttached;
+
+private:
+    static std::mutex _connectMutex;
+    static std::map<std::string, PendingSocketConnection> _pendingConnections;
+    static std::map<std::string, SocketSidebandData*> _stripedConnections;
+};
+
+//---------------------------------------------------------------------
+// Extra connection of a SOCKETS_STRIPED sideband with its own I/O
+// thread, it moves one slice of each striped frame.
+//---------------------------------------------------------------------
+class SocketStripe
+{
+public:
+    SocketStripe(SocketSidebandData* connection, int64_t cpu);
+    ~SocketStripe();
+
+    void Begin(bool write, char* data, int64_t byteCount);
+    bool Finish();
 
 private:
-    static Semaphore _connectQueue;
-    static bool _nextConnectLowLatency;
-    static int64_t _nextConnectBufferSize;
-    static std::string _nextConnectionId;
+    void Run(int64_t cpu);
+
+private:
+    std::unique_ptr<SocketSidebandData> _connection;
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::condition_variable _done;
+    bool _pending;
+    bool _stop;
+    bool _write;
+    char* _data;
+    int64_t _byteCount;
+    bool _result;
+    std::thread _thread;
 };
 
 #ifdef ENABLE_RDMA_SIDEBAND
@@ -170,6 +570,7 @@ public:
     RdmaSidebandData(const std::string& id, RdmaSidebandDataImp* implementation);
     virtual ~RdmaSidebandData();
     const std::string& UsageId() override;
+    bool GetProperty(::SidebandProperty property, int64_t* value) override;
 
     bool Write(const uint8_t* bytes, int64_t byteCount) override;
     bool Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead) override;
@@ -196,10 +597,19 @@ private:
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 void RegisterSidebandData(SidebandData* sidebandData);
+int64_t GetSidebandDefaultProperty(::SidebandProperty property, int64_t defaultValue);
+
+int64_t CurrentNumaNode();
+void GetSidebandNumaPlacement(::SidebandNumaPolicy* policy, int64_t* node);
+bool ApplyNumaPolicy(void* address, int64_t size, ::SidebandNumaPolicy policy, int64_t node);
+int64_t NumaNodeOfAddress(const void* address);
+uint8_t* AllocateNumaBuffer(int64_t size, ::SidebandNumaPolicy policy, int64_t node);
+void FreeNumaBuffer(uint8_t* buffer, int64_t size);
 
 std::vector<std::string> SplitUrlString(const std::string& s);
 int ConnectIdLength();
 std::string NextConnectionId();
+std::string NextSharedMemoryId();
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
@@ -207,7 +617,11 @@ std::string GetConnectionAddress(::SidebandStrategy strategy);
 
 #ifdef ENABLE_RDMA_SIDEBAND
 std::string GetRdmaAddress();
+std::string GetRdmaConnectionAddress();
 #endif
 
 std::string GetSocketsAddress();
 std::string GetSocketsPort();
+std::string GetUnixSocketsPath();
+std::string GetHypervisorSocketsAddress();
+std::string GetSharedMemoryAddress();
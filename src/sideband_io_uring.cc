@@ -0,0 +1,473 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <iostream>
+#include <cstring>
+#include <sideband_io_uring.h>
+#include <sideband_futex.h>
+
+#ifdef ENABLE_IO_URING_SIDEBAND
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const unsigned IoUringEntries = 8;
+static const unsigned SqPollIdleMilliseconds = 1000;
+
+//---------------------------------------------------------------------
+// Pieces up to this size, like a length prefix, are sent from user
+// memory when the rest of a frame is in registered buffers.
+//---------------------------------------------------------------------
+static const int64_t SmallSendBytes = 64;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketIoUring::SocketIoUring(int socket) :
+    _socket(socket),
+    _ringFd(-1),
+    _sqPoll(false),
+    _systemCalls(0),
+    _queued(0),
+    _submissionRing(nullptr),
+    _submissionRingSize(0),
+    _completionRing(nullptr),
+    _completionRingSize(0),
+    _submissions(nullptr),
+    _submissionsSize(0)
+{
+    memset(&_message, 0, sizeof(_message));
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketIoUring::~SocketIoUring()
+{
+    if (_submissions != nullptr)
+    {
+        munmap(_submissions, _submissionsSize);
+    }
+    if (_completionRing != nullptr)
+    {
+        munmap(_completionRing, _completionRingSize);
+    }
+    if (_submissionRing != nullptr)
+    {
+        munmap(_submissionRing, _submissionRingSize);
+    }
+    if (_ringFd != -1)
+    {
+        close(_ringFd);
+    }
+}
+
+//---------------------------------------------------------------------
+// Needs a kernel with fast poll (5.7) so socket operations that have
+// to wait are armed on the socket instead of taking a worker thread.
+// SQPOLL needs privileges on kernels before 5.11, if it is refused the
+// queues are set up without it.
+//---------------------------------------------------------------------
+bool SocketIoUring::Init(bool sqPoll)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqPoll)
+    {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SqPollIdleMilliseconds;
+        _ringFd = static_cast<int>(syscall(__NR_io_uring_setup, IoUringEntries, &params));
+        _sqPoll = _ringFd >= 0;
+    }
+    if (_ringFd < 0)
+    {
+        memset(&params, 0, sizeof(params));
+        _ringFd = static_cast<int>(syscall(__NR_io_uring_setup, IoUringEntries, &params));
+    }
+    if (_ringFd < 0)
+    {
+        return false;
+    }
+    if ((params.features & IORING_FEAT_FAST_POLL) == 0)
+    {
+        return false;
+    }
+
+    _submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    auto submissionRing = mmap(nullptr, _submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+    if (submissionRing == MAP_FAILED)
+    {
+        return false;
+    }
+    _submissionRing = static_cast<uint8_t*>(submissionRing);
+
+    _completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    auto completionRing = mmap(nullptr, _completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING);
+    if (completionRing == MAP_FAILED)
+    {
+        return false;
+    }
+    _completionRing = static_cast<uint8_t*>(completionRing);
+
+    _submissionsSize = params.sq_entries * sizeof(io_uring_sqe);
+    auto submissions = mmap(nullptr, _submissionsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+    if (submissions == MAP_FAILED)
+    {
+        return false;
+    }
+    _submissions = static_cast<io_uring_sqe*>(submissions);
+
+    _submissionHead = reinterpret_cast<unsigned*>(_submissionRing + params.sq_off.head);
+    _submissionTail = reinterpret_cast<unsigned*>(_submissionRing + params.sq_off.tail);
+    _submissionMask = reinterpret_cast<unsigned*>(_submissionRing + params.sq_off.ring_mask);
+    _submissionFlags = reinterpret_cast<unsigned*>(_submissionRing + params.sq_off.flags);
+    _submissionArray = reinterpret_cast<unsigned*>(_submissionRing + params.sq_off.array);
+    _completionHead = reinterpret_cast<unsigned*>(_completionRing + params.cq_off.head);
+    _completionTail = reinterpret_cast<unsigned*>(_completionRing + params.cq_off.tail);
+    _completionMask = reinterpret_cast<unsigned*>(_completionRing + params.cq_off.ring_mask);
+    _completions = reinterpret_cast<io_uring_cqe*>(_completionRing + params.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_FILES, &_socket, 1) != 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketIoUring::RegisterBuffers(const std::vector<SocketBuffer>& buffers)
+{
+    std::vector<iovec> registered;
+    for (auto& buffer : buffers)
+    {
+        registered.push_back({ buffer.data, static_cast<size_t>(buffer.length) });
+    }
+    if (syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_BUFFERS, registered.data(), static_cast<unsigned>(registered.size())) != 0)
+    {
+        return false;
+    }
+    _registeredBuffers = buffers;
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SocketIoUring::SystemCalls()
+{
+    return _systemCalls;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketIoUring::UsesSqPoll()
+{
+    return _sqPoll;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int SocketIoUring::RegisteredBuffer(const SocketBuffer& buffer)
+{
+    for (size_t x = 0; x < _registeredBuffers.size(); ++x)
+    {
+        auto& registered = _registeredBuffers[x];
+        if (buffer.data >= registered.data && buffer.data + buffer.length <= registered.data + registered.length)
+        {
+            return static_cast<int>(x);
+        }
+    }
+    return -1;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+io_uring_sqe* SocketIoUring::NextSubmission()
+{
+    auto tail = *_submissionTail + _queued;
+    auto index = tail & *_submissionMask;
+    auto submission = &_submissions[index];
+    memset(submission, 0, sizeof(io_uring_sqe));
+    submission->fd = 0;
+    submission->flags = IOSQE_FIXED_FILE;
+    submission->user_data = _queued;
+    _submissionArray[index] = index;
+    ++_queued;
+    return submission;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int SocketIoUring::Enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    ++_systemCalls;
+    return static_cast<int>(syscall(__NR_io_uring_enter, _ringFd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+unsigned SocketIoUring::CompletionsReady()
+{
+    return __atomic_load_n(_completionTail, __ATOMIC_ACQUIRE) - *_completionHead;
+}
+
+//---------------------------------------------------------------------
+// Spinning policies poll the completion queue from user space, blocking
+// submits and waits in the same io_uring_enter.
+//---------------------------------------------------------------------
+bool SocketIoUring::WaitForCompletions(unsigned toSubmit, unsigned count, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    if (policy != ::SidebandWaitPolicy::BLOCK)
+    {
+        if (toSubmit != 0)
+        {
+            if (Enter(toSubmit, 0, 0) < 0)
+            {
+                return false;
+            }
+            toSubmit = 0;
+        }
+        SpinForCondition([&]() { return CompletionsReady() >= count; }, policy, spinMicroseconds);
+    }
+    while (CompletionsReady() < count)
+    {
+        auto result = Enter(toSubmit, count - CompletionsReady(), IORING_ENTER_GETEVENTS);
+        if (result < 0 && errno != EINTR && errno != EAGAIN)
+        {
+            return false;
+        }
+        if (result >= 0)
+        {
+            toSubmit = 0;
+        }
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Publishes the queued submissions and waits until all of them have
+// completed, results are stored in submission order.
+//---------------------------------------------------------------------
+bool SocketIoUring::Submit(unsigned count, int64_t* results, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    __atomic_store_n(_submissionTail, *_submissionTail + _queued, __ATOMIC_RELEASE);
+    _queued = 0;
+    unsigned toSubmit = count;
+    if (_sqPoll)
+    {
+        // The kernel thread goes to sleep after being idle and has to be woken
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(_submissionFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+        {
+            Enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        toSubmit = 0;
+    }
+    if (!WaitForCompletions(toSubmit, count, policy, spinMicroseconds))
+    {
+        std::cout << "io_uring_enter failed with error: " << errno << std::endl;
+        return false;
+    }
+    auto head = *_completionHead;
+    for (unsigned x = 0; x < count; ++x)
+    {
+        auto& completion = _completions[head & *_completionMask];
+        results[completion.user_data] = completion.res;
+        ++head;
+    }
+    __atomic_store_n(_completionHead, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Frames whose pieces are either small or in registered buffers go out
+// as linked writes in one submission so the registered pages are used,
+// anything else is a single sendmsg.  A short send only breaks the link
+// with MSG_WAITALL, without it the pieces linked after it would still go
+// out and the stream would lose bytes in the middle of a frame.  Returns
+// the number of bytes sent from the start of the buffers.
+//---------------------------------------------------------------------
+int64_t SocketIoUring::Send(SocketBuffer* buffers, int count, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    bool fixed = !_registeredBuffers.empty();
+    for (int x = 0; x < count && fixed; ++x)
+    {
+        fixed = buffers[x].length <= SmallSendBytes || RegisteredBuffer(buffers[x]) >= 0;
+    }
+    int64_t results[4] = { 0 };
+    unsigned submitted = 0;
+    if (fixed && count <= 4)
+    {
+        for (int x = 0; x < count; ++x)
+        {
+            auto submission = NextSubmission();
+            auto registered = RegisteredBuffer(buffers[x]);
+            submission->opcode = registered >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+            submission->addr = reinterpret_cast<uint64_t>(buffers[x].data);
+            submission->len = static_cast<uint32_t>(buffers[x].length);
+            submission->buf_index = registered >= 0 ? registered : 0;
+            if (x + 1 < count)
+            {
+                submission->flags |= IOSQE_IO_LINK;
+            }
+            if (registered < 0)
+            {
+                // MSG_MORE holds a small piece back until the rest of the
+                // frame follows instead of sending it on its own
+                submission->msg_flags = MSG_WAITALL | (x + 1 < count ? MSG_MORE : 0);
+            }
+        }
+        submitted = count;
+    }
+    else
+    {
+        for (int x = 0; x < count && x < 4; ++x)
+        {
+            _messageBuffers[x].iov_base = buffers[x].data;
+            _messageBuffers[x].iov_len = buffers[x].length;
+        }
+        memset(&_message, 0, sizeof(_message));
+        _message.msg_iov = _messageBuffers;
+        _message.msg_iovlen = count < 4 ? count : 4;
+        auto submission = NextSubmission();
+        submission->opcode = IORING_OP_SENDMSG;
+        submission->addr = reinterpret_cast<uint64_t>(&_message);
+        submission->len = 1;
+        submitted = 1;
+    }
+    if (!Submit(submitted, results, policy, spinMicroseconds))
+    {
+        return -1;
+    }
+    if (results[0] < 0)
+    {
+        errno = static_cast<int>(-results[0]);
+        return -1;
+    }
+    if (submitted == 1)
+    {
+        return results[0];
+    }
+    // A short write cancels the writes linked after it
+    int64_t sent = 0;
+    for (unsigned x = 0; x < submitted && results[x] >= 0; ++x)
+    {
+        sent += results[x];
+        if (results[x] < buffers[x].length)
+        {
+            break;
+        }
+    }
+    return sent;
+}
+
+//---------------------------------------------------------------------
+// Reads into a registered buffer use the fixed pages.  Record sockets
+// need MSG_TRUNC to report the record length so they always use recv.
+//---------------------------------------------------------------------
+int64_t SocketIoUring::Receive(SocketBuffer* buffers, int count, bool truncate, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    auto submission = NextSubmission();
+    auto registered = count == 1 && !truncate ? RegisteredBuffer(buffers[0]) : -1;
+    if (registered >= 0)
+    {
+        submission->opcode = IORING_OP_READ_FIXED;
+        submission->addr = reinterpret_cast<uint64_t>(buffers[0].data);
+        submission->len = static_cast<uint32_t>(buffers[0].length);
+        submission->buf_index = registered;
+    }
+    else if (count == 1)
+    {
+        submission->opcode = IORING_OP_RECV;
+        submission->addr = reinterpret_cast<uint64_t>(buffers[0].data);
+        submission->len = static_cast<uint32_t>(buffers[0].length);
+        submission->msg_flags = truncate ? MSG_TRUNC : 0;
+    }
+    else
+    {
+        for (int x = 0; x < count && x < 4; ++x)
+        {
+            _messageBuffers[x].iov_base = buffers[x].data;
+            _messageBuffers[x].iov_len = buffers[x].length;
+        }
+        memset(&_message, 0, sizeof(_message));
+        _message.msg_iov = _messageBuffers;
+        _message.msg_iovlen = count < 4 ? count : 4;
+        submission->opcode = IORING_OP_RECVMSG;
+        submission->addr = reinterpret_cast<uint64_t>(&_message);
+        submission->len = 1;
+        submission->msg_flags = truncate ? MSG_TRUNC : 0;
+    }
+    int64_t result = 0;
+    if (!Submit(1, &result, policy, spinMicroseconds))
+    {
+        return -1;
+    }
+    if (result < 0)
+    {
+        errno = static_cast<int>(-result);
+        return -1;
+    }
+    return result;
+}
+
+#else
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketIoUring::SocketIoUring(int socket)
+{
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketIoUring::~SocketIoUring()
+{
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketIoUring::Init(bool sqPoll)
+{
+    return false;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketIoUring::RegisterBuffers(const std::vector<SocketBuffer>& buffers)
+{
+    return false;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SocketIoUring::Send(SocketBuffer* buffers, int count, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    return -1;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SocketIoUring::Receive(SocketBuffer* buffers, int count, bool truncate, ::SidebandWaitPolicy policy, int64_t spinMicroseconds)
+{
+    return -1;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SocketIoUring::SystemCalls()
+{
+    return 0;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketIoUring::UsesSqPoll()
+{
+    return false;
+}
+
+#endif
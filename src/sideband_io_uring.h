@@ -0,0 +1,74 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#pragma once
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <cstdint>
+#include <vector>
+#include <sideband_data.h>
+#include <sideband_internal.h>
+
+#ifdef ENABLE_IO_URING_SIDEBAND
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <linux/io_uring.h>
+#endif
+
+//---------------------------------------------------------------------
+// io_uring submission and completion queues for a single socket.  The
+// socket is registered as a fixed file and buffers the sideband owns
+// can be registered so the kernel does not map them for each transfer.
+// With SQPOLL a kernel thread picks up submissions, a transfer then
+// needs no system call unless the caller blocks for the completion.
+// Without ENABLE_IO_URING_SIDEBAND Init always fails and callers use
+// plain socket calls.
+//---------------------------------------------------------------------
+class SocketIoUring
+{
+public:
+    SocketIoUring(int socket);
+    ~SocketIoUring();
+
+    bool Init(bool sqPoll);
+    bool RegisterBuffers(const std::vector<SocketBuffer>& buffers);
+    int64_t Send(SocketBuffer* buffers, int count, ::SidebandWaitPolicy policy, int64_t spinMicroseconds);
+    int64_t Receive(SocketBuffer* buffers, int count, bool truncate, ::SidebandWaitPolicy policy, int64_t spinMicroseconds);
+    int64_t SystemCalls();
+    bool UsesSqPoll();
+
+#ifdef ENABLE_IO_URING_SIDEBAND
+private:
+    io_uring_sqe* NextSubmission();
+    bool Submit(unsigned count, int64_t* results, ::SidebandWaitPolicy policy, int64_t spinMicroseconds);
+    int Enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    unsigned CompletionsReady();
+    bool WaitForCompletions(unsigned toSubmit, unsigned count, ::SidebandWaitPolicy policy, int64_t spinMicroseconds);
+    int RegisteredBuffer(const SocketBuffer& buffer);
+
+private:
+    int _socket;
+    int _ringFd;
+    bool _sqPoll;
+    int64_t _systemCalls;
+    unsigned _queued;
+    uint8_t* _submissionRing;
+    size_t _submissionRingSize;
+    uint8_t* _completionRing;
+    size_t _completionRingSize;
+    io_uring_sqe* _submissions;
+    size_t _submissionsSize;
+    unsigned* _submissionHead;
+    unsigned* _submissionTail;
+    unsigned* _submissionMask;
+    unsigned* _submissionFlags;
+    unsigned* _submissionArray;
+    unsigned* _completionHead;
+    unsigned* _completionTail;
+    unsigned* _completionMask;
+    io_uring_cqe* _completions;
+    std::vector<SocketBuffer> _registeredBuffers;
+    iovec _messageBuffers[4];
+    msghdr _message;
+#endif
+};
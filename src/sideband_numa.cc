@@ -0,0 +1,189 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <iostream>
+#include <sideband_data.h>
+#include <sideband_internal.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#elif defined(_WIN32)
+#include <psapi.h>
+#else
+#include <cstdlib>
+#endif
+
+#ifdef __linux__
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int MaxNumaNodes = 1024;
+static const int NumaMaskLongs = MaxNumaNodes / (8 * sizeof(unsigned long));
+
+//---------------------------------------------------------------------
+// The kernel ignores the last bit of maxnode, pass one more than the
+// number of bits in the mask.
+//---------------------------------------------------------------------
+static bool BindToNodes(void* address, int64_t size, int mode, const unsigned long* mask)
+{
+    if (syscall(SYS_mbind, address, size, mode, mask, MaxNumaNodes + 1, 0) == -1)
+    {
+        std::cout << "Could not apply the NUMA policy " << errno << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t CurrentNumaNode()
+{
+#ifdef __linux__
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == -1)
+    {
+        return -1;
+    }
+    return node;
+#elif defined(_WIN32)
+    PROCESSOR_NUMBER processor;
+    USHORT node = 0;
+    GetCurrentProcessorNumberEx(&processor);
+    if (!GetNumaProcessorNodeEx(&processor, &node))
+    {
+        return -1;
+    }
+    return node;
+#else
+    return -1;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Reads the NUMA properties for a sideband that is being created.  The
+// local policy is resolved to the node of the calling thread right away
+// so memory that is mapped later on another thread still lands there.
+//---------------------------------------------------------------------
+void GetSidebandNumaPlacement(::SidebandNumaPolicy* policy, int64_t* node)
+{
+    *policy = static_cast<::SidebandNumaPolicy>(GetSidebandDefaultProperty(::SidebandProperty::NUMA_POLICY, static_cast<int64_t>(::SidebandNumaPolicy::DEFAULT)));
+    *node = GetSidebandDefaultProperty(::SidebandProperty::NUMA_NODE, -1);
+    if (*policy == ::SidebandNumaPolicy::LOCAL)
+    {
+        *policy = ::SidebandNumaPolicy::NODE;
+        *node = CurrentNumaNode();
+    }
+    if (*policy == ::SidebandNumaPolicy::NODE && *node < 0)
+    {
+        *policy = ::SidebandNumaPolicy::DEFAULT;
+    }
+}
+
+//---------------------------------------------------------------------
+// Applies the policy to pages that have not been touched yet.  Windows
+// picks the node when memory is allocated, see AllocateNumaBuffer and
+// SharedMemoryRegion::Init.
+//---------------------------------------------------------------------
+bool ApplyNumaPolicy(void* address, int64_t size, ::SidebandNumaPolicy policy, int64_t node)
+{
+#ifdef __linux__
+    unsigned long mask[NumaMaskLongs] = {};
+    switch (policy)
+    {
+        case ::SidebandNumaPolicy::NODE:
+            if (node >= MaxNumaNodes)
+            {
+                return false;
+            }
+            mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+            return BindToNodes(address, size, MPOL_BIND, mask);
+        case ::SidebandNumaPolicy::INTERLEAVE:
+            if (syscall(SYS_get_mempolicy, nullptr, mask, MaxNumaNodes + 1, nullptr, MPOL_F_MEMS_ALLOWED) == -1)
+            {
+                return false;
+            }
+            return BindToNodes(address, size, MPOL_INTERLEAVE, mask);
+        default:
+            return true;
+    }
+#else
+    return policy == ::SidebandNumaPolicy::DEFAULT;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Returns the node of the page at the address, faulting it in if
+// needed, or -1 if it is not known.
+//---------------------------------------------------------------------
+int64_t NumaNodeOfAddress(const void* address)
+{
+    if (address == nullptr)
+    {
+        return -1;
+    }
+#ifdef __linux__
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE | MPOL_F_ADDR) == -1)
+    {
+        return -1;
+    }
+    return node;
+#elif defined(_WIN32)
+    PSAPI_WORKING_SET_EX_INFORMATION info = {};
+    info.VirtualAddress = const_cast<void*>(address);
+    static_cast<const volatile uint8_t*>(address)[0];
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid)
+    {
+        return -1;
+    }
+    return info.VirtualAttributes.Node;
+#else
+    return -1;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Page aligned allocation placed according to the NUMA policy.  Used
+// for buffers that are private to one process.
+//---------------------------------------------------------------------
+uint8_t* AllocateNumaBuffer(int64_t size, ::SidebandNumaPolicy policy, int64_t node)
+{
+#ifdef __linux__
+    auto buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    ApplyNumaPolicy(buffer, size, policy, node);
+    return static_cast<uint8_t*>(buffer);
+#elif defined(_WIN32)
+    if (policy == ::SidebandNumaPolicy::NODE)
+    {
+        return static_cast<uint8_t*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node)));
+    }
+    return static_cast<uint8_t*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+    return static_cast<uint8_t*>(calloc(1, size));
+#endif
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void FreeNumaBuffer(uint8_t* buffer, int64_t size)
+{
+    if (buffer == nullptr)
+    {
+        return;
+    }
+#ifdef __linux__
+    munmap(buffer, size);
+#elif defined(_WIN32)
+    VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+    free(buffer);
+#endif
+}
@@ -2,9 +2,13 @@
 //---------------------------------------------------------------------
 #include <iostream>
 #include <cstring>
-//#include <vector>
 #include <cassert>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
 #include <sideband_data.h>
 #include <sideband_internal.h>
 
@@ -17,14 +21,46 @@
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 int32_t timeoutMs = -1;
-int MaxConcurrentTransactions = 1;
+static const int64_t DefaultRdmaPipelineDepth = 2;
+static const int64_t MaxRdmaPipelineDepth = 64;
+static const int64_t RdmaQueueTimeoutMilliseconds = 10000;
+
+//---------------------------------------------------------------------
+// Peers without RDMA_PIPELINE_DEPTH post the default number of receive
+// regions, so the count never goes below it.
+//---------------------------------------------------------------------
+static int64_t ClampRdmaPipelineDepth(int64_t depth)
+{
+    return depth < DefaultRdmaPipelineDepth ? DefaultRdmaPipelineDepth : (depth > MaxRdmaPipelineDepth ? MaxRdmaPipelineDepth : depth);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t RdmaPipelineDepth()
+{
+    return ClampRdmaPipelineDepth(GetSidebandDefaultProperty(::SidebandProperty::RDMA_PIPELINE_DEPTH, DefaultRdmaPipelineDepth));
+}
+
+//---------------------------------------------------------------------
+// Settings and accepted sessions of a queued sideband.
+//---------------------------------------------------------------------
+struct PendingRdmaConnection
+{
+    bool lowLatency;
+    bool waitForReader;
+    bool waitForWriter;
+    int64_t bufferSize;
+    int64_t pipelineDepth;
+    easyrdma_Session writeSession;
+    easyrdma_Session readSession;
+};
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 class RdmaSidebandDataImp
 {
 public:
-    RdmaSidebandDataImp(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, bool lowLatency, int64_t bufferSize);
+    RdmaSidebandDataImp(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, bool lowLatency, int64_t bufferSize, int64_t pipelineDepth);
     ~RdmaSidebandDataImp();
 
     bool Write(const uint8_t* bytes, int64_t bytecount);
@@ -40,10 +76,14 @@ public:
     bool FinishDirectWrite(int64_t byteCount);
 
     int64_t BufferSize();    
+    int64_t PipelineDepth();
 
     static void QueueSidebandConnection(::SidebandStrategy strategy, const std::string& id, bool waitForReader, bool waitForWriter, int64_t bufferSize);
     static RdmaSidebandData* InitFromConnection(easyrdma_Session connectedSession, bool isWriteSession);
-    static RdmaSidebandData* ClientInitFromConnection(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, const std::string& id, bool lowLatency, int64_t bufferSize);
+    static RdmaSidebandData* ClientInitFromConnection(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, const std::string& id, bool lowLatency, int64_t bufferSize, int64_t pipelineDepth);
+
+private:
+    static void DropPendingConnection();
 
 private:
     bool _lowLatency;
@@ -52,16 +92,15 @@ private:
     easyrdma_InternalBufferRegion _writeBuffer;
     easyrdma_InternalBufferRegion _readBuffer;
     int64_t _bufferSize;
+    int64_t _pipelineDepth;
 
 private:    
-    static Semaphore _rdmaConnectQueue;
-    static easyrdma_Session _pendingWriteSession;
-    static easyrdma_Session _pendingReadSession;
-    static bool _nextConnectLowLatency;
-    static bool _waitForReaderConnection;
-    static bool _waitForWriteConnection;
-    static int64_t _nextConnectBufferSize;
-    static std::string _nextConnectionId;
+    static std::mutex _connectMutex;
+    static std::condition_variable _connectComplete;
+    static bool _connectPending;
+    static std::chrono::steady_clock::time_point _pendingDeadline;
+    static std::string _pendingId;
+    static PendingRdmaConnection _pendingConnection;
 };
 
 //---------------------------------------------------------------------
@@ -86,6 +125,18 @@ void RdmaSidebandData::QueueSidebandConnection(::SidebandStrategy strategy, cons
     RdmaSidebandDataImp::QueueSidebandConnection(strategy, id, waitForReader, waitForWriter, bufferSize);
 }
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RdmaSidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    if (property == ::SidebandProperty::RDMA_PIPELINE_DEPTH)
+    {
+        *value = _imp->PipelineDepth();
+        return true;
+    }
+    return SidebandData::GetProperty(property, value);
+}
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 RdmaSidebandData* RdmaSidebandData::ClientInit(const std::string& sidebandServiceUrl, bool lowLatency, const std::string& usageId, int64_t bufferSize)
@@ -96,6 +147,11 @@ RdmaSidebandData* RdmaSidebandData::ClientInit(const std::string& sidebandServic
 
     auto localAddress = GetRdmaAddress();
     auto tokens = SplitUrlString(sidebandServiceUrl);
+    auto pipelineDepth = DefaultRdmaPipelineDepth;
+    if (tokens.size() > 2)
+    {
+        pipelineDepth = ClampRdmaPipelineDepth(std::strtoll(tokens[2].c_str(), nullptr, 10));
+    }
 
     std::cout << "Client connetion using local address: " << localAddress << std::endl;
 
@@ -136,7 +192,7 @@ RdmaSidebandData* RdmaSidebandData::ClientInit(const std::string& sidebandServic
     }
     assert(result == easyrdma_Error_Success);
 
-    auto sidebandData = RdmaSidebandDataImp::ClientInitFromConnection(clientWriteSession, clientReadSession, usageId, lowLatency, bufferSize);
+    auto sidebandData = RdmaSidebandDataImp::ClientInitFromConnection(clientWriteSession, clientReadSession, usageId, lowLatency, bufferSize, pipelineDepth);
     return sidebandData;
 }
 
@@ -219,29 +275,33 @@ const std::string& RdmaSidebandData::UsageId()
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-Semaphore RdmaSidebandDataImp::_rdmaConnectQueue;
-easyrdma_Session RdmaSidebandDataImp::_pendingWriteSession;
-easyrdma_Session RdmaSidebandDataImp::_pendingReadSession;
-bool RdmaSidebandDataImp::_nextConnectLowLatency;
-bool RdmaSidebandDataImp::_waitForReaderConnection;
-bool RdmaSidebandDataImp::_waitForWriteConnection;
-int64_t RdmaSidebandDataImp::_nextConnectBufferSize;
-std::string RdmaSidebandDataImp::_nextConnectionId;
+std::mutex RdmaSidebandDataImp::_connectMutex;
+std::condition_variable RdmaSidebandDataImp::_connectComplete;
+bool RdmaSidebandDataImp::_connectPending = false;
+std::chrono::steady_clock::time_point RdmaSidebandDataImp::_pendingDeadline;
+std::string RdmaSidebandDataImp::_pendingId;
+PendingRdmaConnection RdmaSidebandDataImp::_pendingConnection;
 
 //---------------------------------------------------------------------
+// Each side posts pipelineDepth receive regions and has as many send
+// regions, so a writer can queue that many frames before
+// easyrdma_AcquireSendRegion waits for a completion.  Both sides take
+// the count from the owner's connection address, so it is the same in
+// every direction that is connected.
 //---------------------------------------------------------------------
-RdmaSidebandDataImp::RdmaSidebandDataImp(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, bool lowLatency, int64_t bufferSize) :
+RdmaSidebandDataImp::RdmaSidebandDataImp(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, bool lowLatency, int64_t bufferSize, int64_t pipelineDepth) :
     _connectedWriteSession(connectedWriteSession),
     _connectedReadSession(connectedReadSession),
     _lowLatency(lowLatency),
-    _bufferSize(bufferSize)
+    _bufferSize(bufferSize),
+    _pipelineDepth(pipelineDepth)
 {
-    auto result = easyrdma_ConfigureBuffers(_connectedWriteSession, _bufferSize, 2);
+    auto result = easyrdma_ConfigureBuffers(_connectedWriteSession, _bufferSize, _pipelineDepth);
     if (result != 0)
     {
         std::cout << "Failed easyrdma_ConfigureExternalBuffer: " << result << std::endl;
     }
-    result = easyrdma_ConfigureBuffers(_connectedReadSession, _bufferSize, 2);
+    result = easyrdma_ConfigureBuffers(_connectedReadSession, _bufferSize, _pipelineDepth);
     if (result != 0)
     {
         std::cout << "Failed easyrdma_ConfigureBuffers: " << result << std::endl;
@@ -271,66 +331,119 @@ RdmaSidebandDataImp::~RdmaSidebandDataImp()
 }
 
 //---------------------------------------------------------------------
+// easyrdma does not pass the sideband id when a session connects, so
+// only one sideband at a time can wait for its sessions.  Queueing the
+// next one waits until the previous one has connected, or for at most
+// RdmaQueueTimeoutMilliseconds after it was queued, then the previous
+// one is dropped.
 //---------------------------------------------------------------------
 void RdmaSidebandDataImp::QueueSidebandConnection(::SidebandStrategy strategy, const std::string& id, bool waitForReader, bool waitForWriter, int64_t bufferSize)
 {
-    _rdmaConnectQueue.wait();
-    _pendingWriteSession = easyrdma_InvalidSession;
-    _pendingReadSession = easyrdma_InvalidSession;
+    PendingRdmaConnection pending;
 #ifdef _WIN32
-    _nextConnectLowLatency = false;
+    pending.lowLatency = false;
 #else
-    _nextConnectLowLatency = strategy == ::SidebandStrategy::RDMA_LOW_LATENCY;
+    pending.lowLatency = strategy == ::SidebandStrategy::RDMA_LOW_LATENCY;
 #endif
-    _nextConnectBufferSize = bufferSize;
-    _waitForReaderConnection = waitForReader;
-    _waitForWriteConnection = waitForWriter;
-    _nextConnectionId = id;
+    pending.waitForReader = waitForReader;
+    pending.waitForWriter = waitForWriter;
+    pending.bufferSize = bufferSize;
+    pending.pipelineDepth = RdmaPipelineDepth();
+    pending.writeSession = easyrdma_InvalidSession;
+    pending.readSession = easyrdma_InvalidSession;
+
+    if (!waitForReader && !waitForWriter)
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_connectMutex);
+    while (_connectPending)
+    {
+        if (_connectComplete.wait_until(lock, _pendingDeadline) == std::cv_status::timeout &&
+            _connectPending && std::chrono::steady_clock::now() >= _pendingDeadline)
+        {
+            DropPendingConnection();
+        }
+    }
+    _connectPending = true;
+    _pendingDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RdmaQueueTimeoutMilliseconds);
+    _pendingId = id;
+    _pendingConnection = pending;
 }
 
 //---------------------------------------------------------------------
+// Gives up on the queued sideband whose client did not connect in time
+// and closes the sessions it already accepted.  Called with the connect
+// lock held.
 //---------------------------------------------------------------------
-RdmaSidebandData* RdmaSidebandDataImp::ClientInitFromConnection(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, const std::string& id, bool lowLatency, int64_t bufferSize)
+void RdmaSidebandDataImp::DropPendingConnection()
 {
-    auto imp = new RdmaSidebandDataImp(connectedWriteSession, connectedReadSession, lowLatency, bufferSize);
+    std::cout << "RDMA sideband " << _pendingId << " was never connected, dropping it." << std::endl;
+    if (_pendingConnection.writeSession != easyrdma_InvalidSession)
+    {
+        easyrdma_CloseSession(_pendingConnection.writeSession);
+    }
+    if (_pendingConnection.readSession != easyrdma_InvalidSession)
+    {
+        easyrdma_CloseSession(_pendingConnection.readSession);
+    }
+    _connectPending = false;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+RdmaSidebandData* RdmaSidebandDataImp::ClientInitFromConnection(easyrdma_Session connectedWriteSession, easyrdma_Session connectedReadSession, const std::string& id, bool lowLatency, int64_t bufferSize, int64_t pipelineDepth)
+{
+    auto imp = new RdmaSidebandDataImp(connectedWriteSession, connectedReadSession, lowLatency, bufferSize, pipelineDepth);
     auto sidebandData = new RdmaSidebandData(id, imp);
     RegisterSidebandData(sidebandData);
     return sidebandData;        
 }
 
 //---------------------------------------------------------------------
+// Accepted sessions belong to the one queued sideband, sessions that
+// arrive while none is queued or for a direction it already has are
+// closed.
 //---------------------------------------------------------------------
 RdmaSidebandData* RdmaSidebandDataImp::InitFromConnection(easyrdma_Session connectedSession, bool isWriteSession)
 {
-    if (isWriteSession)
+    std::unique_lock<std::mutex> lock(_connectMutex);
+    auto& session = isWriteSession ? _pendingConnection.writeSession : _pendingConnection.readSession;
+    auto expected = isWriteSession ? _pendingConnection.waitForWriter : _pendingConnection.waitForReader;
+    if (!_connectPending || !expected || session != easyrdma_InvalidSession)
     {
-        _pendingWriteSession = connectedSession;
+        std::cout << "RDMA connection was not queued, closing it." << std::endl;
+        lock.unlock();
+        easyrdma_CloseSession(connectedSession);
+        return nullptr;
     }
-    else
+    session = connectedSession;
+    auto pending = _pendingConnection;
+    if ((pending.writeSession == easyrdma_InvalidSession && pending.waitForWriter) ||
+        (pending.readSession == easyrdma_InvalidSession && pending.waitForReader))
     {
-        _pendingReadSession = connectedSession;
+        return nullptr;
     }
-    if ((_pendingWriteSession != easyrdma_InvalidSession || !_waitForWriteConnection) &&
-        (_pendingReadSession != easyrdma_InvalidSession || !_waitForReaderConnection))
+    auto id = _pendingId;
+    _connectPending = false;
+    _connectComplete.notify_all();
+    lock.unlock();
+
+    if (pending.lowLatency && pending.readSession != easyrdma_InvalidSession)
     {
-        if (_nextConnectLowLatency && _pendingReadSession != easyrdma_InvalidSession)
+        std::cout << "Setting low latency" << std::endl;
+        bool usePooling = true;
+        auto result = easyrdma_SetProperty(pending.readSession, easyrdma_Property_UseRxPolling, &usePooling, sizeof(bool));
+        if (result != easyrdma_Error_Success)
         {
-            std::cout << "Setting low latency" << std::endl;
-            bool usePooling = true;
-            auto result = easyrdma_SetProperty(_pendingReadSession, easyrdma_Property_UseRxPolling, &usePooling, sizeof(bool));
-            if (result != easyrdma_Error_Success)
-            {
-                std::cout << "Failed to connect: " << result << std::endl;
-            }
-            assert(result == easyrdma_Error_Success);
+            std::cout << "Failed to connect: " << result << std::endl;
         }
-        auto imp = new RdmaSidebandDataImp(_pendingWriteSession, _pendingReadSession, _nextConnectLowLatency, _nextConnectBufferSize);
-        auto sidebandData = new RdmaSidebandData(_nextConnectionId, imp);
-        RegisterSidebandData(sidebandData);
-        _rdmaConnectQueue.notify();
-        return sidebandData;        
+        assert(result == easyrdma_Error_Success);
     }
-    return nullptr;
+    auto imp = new RdmaSidebandDataImp(pending.writeSession, pending.readSession, pending.lowLatency, pending.bufferSize, pending.pipelineDepth);
+    auto sidebandData = new RdmaSidebandData(id, imp);
+    RegisterSidebandData(sidebandData);
+    return sidebandData;        
 }
 
 //---------------------------------------------------------------------
@@ -403,6 +516,7 @@ bool RdmaSidebandDataImp::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferS
 {    
     memcpy(bytes, static_cast<uint8_t*>(_readBuffer.buffer) + sizeof(int64_t), bufferSize);
     *numBytesRead = bufferSize;
+    easyrdma_ReleaseReceivedBufferRegion(_connectedReadSession, &_readBuffer);
     return true;
 }
 
@@ -478,6 +592,29 @@ int64_t RdmaSidebandDataImp::BufferSize()
     return _bufferSize;
 }
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t RdmaSidebandDataImp::PipelineDepth()
+{
+    return _pipelineDepth;
+}
+
+//---------------------------------------------------------------------
+// The owner's pipeline depth is passed to the client as a third field
+// of the address when it is not the default.  Clients that predate it
+// only read the address and port.
+//---------------------------------------------------------------------
+std::string GetRdmaConnectionAddress()
+{
+    auto address = GetRdmaAddress() + ":50060";
+    auto pipelineDepth = RdmaPipelineDepth();
+    if (pipelineDepth != DefaultRdmaPipelineDepth)
+    {
+        address += ":" + std::to_string(pipelineDepth);
+    }
+    return address;
+}
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 std::string GetRdmaAddress()
@@ -2,36 +2,363 @@
 //---------------------------------------------------------------------
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <sideband_data.h>
 #include <sideband_internal.h>
+#include <sideband_futex.h>
 
 #ifndef _WIN32
 #include <sys/mman.h>        // shared memory
 #include <sys/stat.h>        // mode constants
+#include <sys/vfs.h>         // fstatfs
 #include <fcntl.h>           // O_* constants
 #include <unistd.h>          // ftruncate
 #include <errno.h>
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>     // memfd_create
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <cstddef>
+#endif
+
+#ifdef __linux__
 //---------------------------------------------------------------------
+// On Linux each shared memory region is an anonymous memfd.  The owner
+// hands the file descriptor to clients over a unix domain socket in the
+// abstract namespace, so regions have no names that can collide and
+// there is nothing in /dev/shm to unlink.
 //---------------------------------------------------------------------
-SharedMemorySidebandData::SharedMemorySidebandData(const std::string& id, int64_t bufferSize) :
-    SidebandData(bufferSize),
+static std::mutex s_SharedMemoryRegionsMutex;
+static std::map<std::string, std::vector<int>> s_SharedMemoryRegions;
+static std::once_flag s_SharedMemoryHandshakeStarted;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct SharedMemoryHandshakeResponse
+{
+    int32_t status;
+    int32_t fdCount;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int MaxSharedMemoryHandshakeFds = 4;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static std::string SharedMemoryHandshakeAddress()
+{
+    return "@ni_grpc_sideband_" + std::to_string(getpid());
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static socklen_t SharedMemoryHandshakeSocketAddress(const std::string& address, sockaddr_un* socketAddress)
+{
+    memset(socketAddress, 0, sizeof(sockaddr_un));
+    socketAddress->sun_family = AF_UNIX;
+    auto name = address.substr(1, sizeof(socketAddress->sun_path) - 2);
+    memcpy(socketAddress->sun_path + 1, name.c_str(), name.length());
+    return offsetof(sockaddr_un, sun_path) + 1 + name.length();
+}
+
+//---------------------------------------------------------------------
+// A doorbell is registered without descriptors, its eventfds are only
+// created the first time either side asks for them.  Called with the
+// registry lock held.
+//---------------------------------------------------------------------
+static void CreateDoorbellEventFds(std::vector<int>& fds)
+{
+    auto first = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    auto second = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (first == -1 || second == -1)
+    {
+        std::cout << "Could not create the doorbell " << errno << std::endl;
+        if (first != -1)
+        {
+            close(first);
+        }
+        if (second != -1)
+        {
+            close(second);
+        }
+        return;
+    }
+    fds = std::vector<int> { first, second };
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static void HandleSharedMemoryHandshake(int connection)
+{
+    struct ucred credentials;
+    socklen_t credentialsLength = sizeof(credentials);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLength) == -1 ||
+        (credentials.uid != getuid() && credentials.uid != 0))
+    {
+        std::cout << "Rejected shared memory handshake from another user" << std::endl;
+        return;
+    }
+    struct timeval timeout = { 1, 0 };
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int32_t idLength = 0;
+    char id[256];
+    if (recv(connection, &idLength, sizeof(idLength), MSG_WAITALL) != sizeof(idLength) ||
+        idLength <= 0 || idLength > static_cast<int32_t>(sizeof(id)) ||
+        recv(connection, id, idLength, MSG_WAITALL) != idLength)
+    {
+        std::cout << "Invalid shared memory handshake" << std::endl;
+        return;
+    }
+
+    // Hold the lock until the descriptors have been sent so the region
+    // cannot be closed underneath the handshake.
+    std::unique_lock<std::mutex> lock(s_SharedMemoryRegionsMutex);
+    std::vector<int> fds;
+    auto it = s_SharedMemoryRegions.find(std::string(id, idLength));
+    if (it != s_SharedMemoryRegions.end())
+    {
+        if (it->second.empty())
+        {
+            CreateDoorbellEventFds(it->second);
+        }
+        fds = it->second;
+    }
+
+    SharedMemoryHandshakeResponse response = { fds.size() > 0 ? 0 : -1, static_cast<int32_t>(fds.size()) };
+    struct iovec data = { &response, sizeof(response) };
+    char control[CMSG_SPACE(sizeof(int) * MaxSharedMemoryHandshakeFds)];
+    struct msghdr message = {};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    if (fds.size() > 0)
+    {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+    }
+    sendmsg(connection, &message, MSG_NOSIGNAL);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static void RunSharedMemoryHandshake(int listenSocket)
+{
+    while (true)
+    {
+        auto connection = accept4(listenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            std::cout << "ERROR on shared memory handshake accept " << errno << std::endl;
+            return;
+        }
+        HandleSharedMemoryHandshake(connection);
+        close(connection);
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static void StartSharedMemoryHandshake()
+{
+    auto listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenSocket == -1)
+    {
+        std::cout << "Unable to open the shared memory handshake socket " << errno << std::endl;
+        return;
+    }
+    sockaddr_un address;
+    auto addressLength = SharedMemoryHandshakeSocketAddress(SharedMemoryHandshakeAddress(), &address);
+    if (bind(listenSocket, reinterpret_cast<sockaddr*>(&address), addressLength) == -1 ||
+        listen(listenSocket, SOMAXCONN) == -1)
+    {
+        std::cout << "Unable to listen for shared memory handshakes " << errno << std::endl;
+        close(listenSocket);
+        return;
+    }
+    std::thread handshakeThread(RunSharedMemoryHandshake, listenSocket);
+    handshakeThread.detach();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static void RegisterSharedMemoryRegion(const std::string& id, const std::vector<int>& fds)
+{
+    std::call_once(s_SharedMemoryHandshakeStarted, StartSharedMemoryHandshake);
+    std::unique_lock<std::mutex> lock(s_SharedMemoryRegionsMutex);
+    s_SharedMemoryRegions[id] = fds;
+}
+
+//---------------------------------------------------------------------
+// Returns the descriptors that were registered so a doorbell can close
+// the eventfds the handshake created for it.
+//---------------------------------------------------------------------
+static std::vector<int> UnregisterSharedMemoryRegion(const std::string& id)
+{
+    std::vector<int> fds;
+    std::unique_lock<std::mutex> lock(s_SharedMemoryRegionsMutex);
+    auto it = s_SharedMemoryRegions.find(id);
+    if (it != s_SharedMemoryRegions.end())
+    {
+        fds = it->second;
+        s_SharedMemoryRegions.erase(it);
+    }
+    return fds;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static std::vector<int> GetDoorbellEventFds(const std::string& id)
+{
+    std::unique_lock<std::mutex> lock(s_SharedMemoryRegionsMutex);
+    auto it = s_SharedMemoryRegions.find(id);
+    if (it == s_SharedMemoryRegions.end())
+    {
+        return std::vector<int>();
+    }
+    if (it->second.empty())
+    {
+        CreateDoorbellEventFds(it->second);
+    }
+    return it->second;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static std::vector<int> RequestSharedMemoryRegion(const std::string& address, const std::string& id)
+{
+    std::vector<int> fds;
+    auto connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection == -1)
+    {
+        return fds;
+    }
+    sockaddr_un socketAddress;
+    auto addressLength = SharedMemoryHandshakeSocketAddress(address, &socketAddress);
+    if (connect(connection, reinterpret_cast<sockaddr*>(&socketAddress), addressLength) == -1)
+    {
+        std::cout << "Could not connect to the shared memory owner at " << address << " " << errno << std::endl;
+        close(connection);
+        return fds;
+    }
+
+    int32_t idLength = id.length();
+    struct iovec request[2] = { { &idLength, sizeof(idLength) }, { const_cast<char*>(id.c_str()), id.length() } };
+    struct msghdr requestMessage = {};
+    requestMessage.msg_iov = request;
+    requestMessage.msg_iovlen = 2;
+    sendmsg(connection, &requestMessage, MSG_NOSIGNAL);
+
+    SharedMemoryHandshakeResponse response = { -1, 0 };
+    struct iovec data = { &response, sizeof(response) };
+    char control[CMSG_SPACE(sizeof(int) * MaxSharedMemoryHandshakeFds)];
+    struct msghdr message = {};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(connection, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) == sizeof(response) && response.status == 0)
+    {
+        for (auto header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+                auto count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds.resize(count);
+                memcpy(fds.data(), CMSG_DATA(header), sizeof(int) * count);
+            }
+        }
+    }
+    close(connection);
+    return fds;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int CreateMemoryFile(const std::string& id, int64_t size, int64_t pageSize)
+{
+    int fd = -1;
+    if (pageSize > sysconf(_SC_PAGESIZE))
+    {
+        int pageShift = 0;
+        while ((int64_t(1) << pageShift) < pageSize)
+        {
+            ++pageShift;
+        }
+        fd = syscall(SYS_memfd_create, id.c_str(), MFD_CLOEXEC | MFD_HUGETLB | (pageShift << MFD_HUGE_SHIFT));
+        if (fd != -1 && fallocate(fd, 0, 0, ((size + pageSize - 1) / pageSize) * pageSize) == -1)
+        {
+            // Not enough free huge pages to back the whole region
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1)
+        {
+            std::cout << "Huge pages of " << pageSize << " bytes are not available, using standard pages" << std::endl;
+        }
+    }
+    if (fd == -1)
+    {
+        fd = syscall(SYS_memfd_create, id.c_str(), MFD_CLOEXEC);
+    }
+    return fd;
+}
+#endif
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+std::string GetSharedMemoryAddress()
+{
+#ifdef __linux__
+    return SharedMemoryHandshakeAddress();
+#else
+    return std::string();
+#endif
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SharedMemoryRegion::SharedMemoryRegion(const std::string& id, int64_t size, bool isOwner, const std::string& connectionUrl) :
 #ifdef _WIN32
     _mapFile(INVALID_HANDLE_VALUE),
 #else
     _mapFD(-1),
+    _namedRegion(false),
 #endif
     _buffer(nullptr),
-    _usageId(id),
-    _id("TESTBUFFER_" + id),
-    _bufferSize(bufferSize)
+    _initFailed(false),
+    _id(id),
+    _isOwner(isOwner),
+    _connectionUrl(connectionUrl),
+    _size(size),
+    _mappedSize(0),
+    _pageSize(0)
 {
+    GetSidebandNumaPlacement(&_numaPolicy, &_numaNode);
+    if (GetSidebandDefaultProperty(::SidebandProperty::SHARED_MEMORY_PREFAULT, 0) != 0)
+    {
+        GetBuffer();
+    }
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-SharedMemorySidebandData::~SharedMemorySidebandData()
+SharedMemoryRegion::~SharedMemoryRegion()
 {
 #ifdef _WIN32
     UnmapViewOfFile(_buffer);
@@ -39,126 +366,504 @@ SharedMemorySidebandData::~SharedMemorySidebandData()
 #else
     if(_buffer != nullptr)
     {
-        munmap(_buffer, sizeof(uint8_t*));
-        shm_unlink(_fileName.c_str());
+        munmap(_buffer, _mappedSize);
     }
+    CloseMemoryFile();
 #endif
 }
 
+#ifndef _WIN32
 //---------------------------------------------------------------------
+// The owner's region is unregistered before the file is closed, so the
+// handshake thread never hands out a closed or reused descriptor.
 //---------------------------------------------------------------------
-SharedMemorySidebandData* SharedMemorySidebandData::InitNew(int64_t bufferSize)
+void SharedMemoryRegion::CloseMemoryFile()
 {
-    std::string usageId = "TestBuffer";
-    auto sidebandData = new SharedMemorySidebandData(usageId, bufferSize);
-    return sidebandData;
+    if (_mapFD == -1)
+    {
+        return;
+    }
+#ifdef __linux__
+    if (_isOwner)
+    {
+        UnregisterSharedMemoryRegion(_id);
+    }
+#endif
+    close(_mapFD);
+    _mapFD = -1;
+    if (_namedRegion)
+    {
+        shm_unlink(_fileName.c_str());
+    }
 }
+#endif
 
 //---------------------------------------------------------------------
+// A region that could not be mapped stays unmapped, callers fail
+// without repeating the handshake or the error on every message.
 //---------------------------------------------------------------------
-const std::string& SharedMemorySidebandData::UsageId()
+uint8_t* SharedMemoryRegion::GetBuffer()
 {
-    return _usageId;
+    if (_buffer == nullptr && !_initFailed)
+    {
+        Init();
+        _initFailed = _buffer == nullptr;
+    }
+    return _buffer;
 }
 
 //---------------------------------------------------------------------
+// The buffer if the region is already mapped, without mapping it.
 //---------------------------------------------------------------------
-inline uint8_t* SharedMemorySidebandData::GetBuffer()
+uint8_t* SharedMemoryRegion::MappedBuffer()
 {
-    if (_buffer == nullptr)
-    {
-        Init();
-    }
     return _buffer;
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-void SharedMemorySidebandData::Init()
+int64_t SharedMemoryRegion::PageSize()
 {
+    GetBuffer();
+    return _pageSize;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SharedMemoryRegion::NumaNode()
+{
+    return NumaNodeOfAddress(GetBuffer());
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t RoundUpToPageSize(int64_t size, int64_t pageSize)
+{
+    return ((size + pageSize - 1) / pageSize) * pageSize;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void SharedMemoryRegion::Init()
+{
+    auto requestedPageSize = GetSidebandDefaultProperty(::SidebandProperty::SHARED_MEMORY_PAGE_SIZE, 0);
+    auto prefault = GetSidebandDefaultProperty(::SidebandProperty::SHARED_MEMORY_PREFAULT, 0) != 0;
+    auto lock = GetSidebandDefaultProperty(::SidebandProperty::SHARED_MEMORY_LOCK, 0) != 0;
 #ifdef _WIN32
-    _mapFile = CreateFileMappingA(
-        INVALID_HANDLE_VALUE,    // use paging file
-        NULL,                    // default security
-        PAGE_READWRITE,          // read/write access
-        0,                       // maximum object size (high-order DWORD)
-        _bufferSize,             // maximum object size (low-order DWORD)
-        _id.c_str());            // name of mapping object
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    _pageSize = systemInfo.dwPageSize;
+    _mapFile = NULL;
+    auto largePageSize = static_cast<int64_t>(GetLargePageMinimum());
+    if (requestedPageSize > _pageSize && largePageSize != 0)
+    {
+        // Large pages need the SeLockMemoryPrivilege, fall back to standard pages without it
+        auto mappedSize = RoundUpToPageSize(_size, largePageSize);
+        _mapFile = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES, mappedSize >> 32, mappedSize & 0xFFFFFFFF, _id.c_str());
+        if (_mapFile != NULL)
+        {
+            _pageSize = largePageSize;
+        }
+        else
+        {
+            std::cout << "Large pages are not available, using standard pages " << GetLastError() << std::endl;
+        }
+    }
+    _mappedSize = RoundUpToPageSize(_size, _pageSize);
+    auto preferredNode = _numaPolicy == ::SidebandNumaPolicy::NODE ? static_cast<DWORD>(_numaNode) : NUMA_NO_PREFERRED_NODE;
+    if (_mapFile == NULL)
+    {
+        _mapFile = CreateFileMappingNumaA(
+            INVALID_HANDLE_VALUE,    // use paging file
+            NULL,                    // default security
+            PAGE_READWRITE,          // read/write access
+            _mappedSize >> 32,       // maximum object size (high-order DWORD)
+            _mappedSize & 0xFFFFFFFF, // maximum object size (low-order DWORD)
+            _id.c_str(),             // name of mapping object
+            preferredNode);          // NUMA node for the physical pages
+    }
 
     if (_mapFile == NULL)
     {
         std::cout << "Could not create file mapping object " << GetLastError() << std::endl;
         return;
     }
-    _buffer = (uint8_t*)MapViewOfFile(_mapFile, FILE_MAP_ALL_ACCESS, 0, 0, _bufferSize);
+    _buffer = (uint8_t*)MapViewOfFileExNuma(_mapFile, FILE_MAP_ALL_ACCESS | (_pageSize == largePageSize ? FILE_MAP_LARGE_PAGES : 0), 0, 0, _mappedSize, NULL, preferredNode);
     if (_buffer == NULL)
     {
         std::cout << "Could not map view of file " << GetLastError() << std::endl;
         CloseHandle(_mapFile);
+        return;
+    }
+    if (prefault)
+    {
+        for (int64_t offset = 0; offset < _mappedSize; offset += _pageSize)
+        {
+            static_cast<volatile uint8_t*>(_buffer)[offset];
+        }
+    }
+    if (lock && !VirtualLock(_buffer, _mappedSize))
+    {
+        std::cout << "Could not lock the shared memory " << GetLastError() << std::endl;
     }
 #else
-    _fileName = "/" + _id;
-
-    _mapFD = shm_open(_fileName.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+#ifdef __linux__
+    if (_isOwner)
+    {
+        _mapFD = CreateMemoryFile(_id, _size, requestedPageSize);
+    }
+    else
+    {
+        // The client only maps the region the owner hands over, a region
+        // of its own would never see the owner's data.
+        if (_connectionUrl.length() > 0 && _connectionUrl[0] == '@')
+        {
+            auto fds = RequestSharedMemoryRegion(_connectionUrl, _id);
+            if (fds.size() > 0)
+            {
+                _mapFD = fds[0];
+            }
+        }
+        if (_mapFD == -1)
+        {
+            std::cout << "Could not get shared memory region " << _id << " from " << _connectionUrl << std::endl;
+            return;
+        }
+    }
+#endif
+    if (_mapFD == -1)
+    {
+        // Named regions are used where memfd is not available
+        _namedRegion = true;
+        _fileName = "/" + _id;
+        _mapFD = shm_open(_fileName.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    }
     if(_mapFD == -1)
     {
         std::cout << "Could not open the shared memory location " << errno << std::endl;
         return;
     }
-    if(ftruncate(_mapFD, _bufferSize) == -1)
+#ifdef __linux__
+    if (_isOwner)
+    {
+        RegisterSharedMemoryRegion(_id, std::vector<int> { _mapFD });
+    }
+#endif
+
+    struct statfs fsInfo;
+    _pageSize = fstatfs(_mapFD, &fsInfo) == 0 ? fsInfo.f_bsize : sysconf(_SC_PAGESIZE);
+    _mappedSize = RoundUpToPageSize(_size, _pageSize);
+    struct stat fileInfo;
+    if (fstat(_mapFD, &fileInfo) == 0 && fileInfo.st_size < _mappedSize && ftruncate(_mapFD, _mappedSize) == -1)
     {
         std::cout << "Could not truncate the shared memory file to the given size " << errno << std::endl;
-        shm_unlink(_fileName.c_str());
+        CloseMemoryFile();
         return;
     }
-    _buffer = (uint8_t*)mmap(NULL, _bufferSize, PROT_READ | PROT_WRITE, MAP_SHARED, _mapFD, 0);
+    // The NUMA policy has to be in place before the pages are faulted in
+    auto placed = _numaPolicy != ::SidebandNumaPolicy::DEFAULT;
+    _buffer = (uint8_t*)mmap(NULL, _mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED | (prefault && !placed ? MAP_POPULATE : 0), _mapFD, 0);
     if(_buffer == MAP_FAILED)
     {
         std::cout << "Could not map the shared memory " << errno << std::endl;
-        shm_unlink(_fileName.c_str());
+        _buffer = nullptr;
+        CloseMemoryFile();
         return;
     }
+    if (placed)
+    {
+        ApplyNumaPolicy(_buffer, _mappedSize, _numaPolicy, _numaNode);
+        if (prefault)
+        {
+            for (int64_t offset = 0; offset < _mappedSize; offset += _pageSize)
+            {
+                static_cast<volatile uint8_t*>(_buffer)[offset];
+            }
+        }
+    }
+    if (lock && mlock(_buffer, _mappedSize) == -1)
+    {
+        std::cout << "Could not lock the shared memory " << errno << std::endl;
+    }
 #endif
 }
 
 //---------------------------------------------------------------------
+// A doorbell is a pair of eventfds, one per direction, that a writer
+// signals after it publishes so readers can wait for shared memory
+// sidebands with poll or epoll.  The eventfds travel over the same
+// handshake as the memory files.  A small shared region records which
+// readers asked for the doorbell, writers only pay for the system call
+// when somebody is listening.  Both sides map the flags when the
+// sideband is set up, the eventfds are only created once a reader asks
+// for the doorbell.
 //---------------------------------------------------------------------
-bool SharedMemorySidebandData::Write(const uint8_t* bytes, int64_t bytecount)
+struct DoorbellFlags
 {
-    auto ptr = GetBuffer();
-    if (!ptr)
+    alignas(CacheLineSize) std::atomic<uint32_t> armed;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SharedMemoryDoorbell::SharedMemoryDoorbell(const std::string& id, bool isOwner, const std::string& connectionUrl) :
+    _id(id + "_DOORBELL"),
+    _isOwner(isOwner),
+    _connectionUrl(connectionUrl),
+    _flags(id + "_DOORBELL_FLAGS", 2 * sizeof(DoorbellFlags), isOwner, connectionUrl)
+{
+    _eventFds[0] = -1;
+    _eventFds[1] = -1;
+}
+
+//---------------------------------------------------------------------
+// The owner's eventfds belong to its registry entry, they may have been
+// created by a handshake without the owner ever asking for them.
+//---------------------------------------------------------------------
+SharedMemoryDoorbell::~SharedMemoryDoorbell()
+{
+#ifdef __linux__
+    if (_isOwner)
     {
-        return false;
+        for (auto fd : UnregisterSharedMemoryRegion(_id))
+        {
+            close(fd);
+        }
+        return;
     }
-    memcpy(ptr, bytes, bytecount);
-    return true;
+    for (auto fd : _eventFds)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+#endif
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-bool SharedMemorySidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+bool SharedMemoryDoorbell::OpenEventFds()
 {
-    auto ptr = GetBuffer();
-    if (!ptr)
+#ifdef __linux__
+    if (_eventFds[0] != -1)
     {
+        return true;
+    }
+    auto fds = _isOwner ? GetDoorbellEventFds(_id) : RequestSharedMemoryRegion(_connectionUrl, _id);
+    if (fds.size() != 2)
+    {
+        std::cout << "Could not get the doorbell for " << _id << std::endl;
+        if (!_isOwner)
+        {
+            for (auto fd : fds)
+            {
+                close(fd);
+            }
+        }
         return false;
     }
-    memcpy(bytes, ptr, bufferSize);
+    _eventFds[0] = fds[0];
+    _eventFds[1] = fds[1];
     return true;
+#else
+    return false;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Maps the flags so publishing a message never has to.  The owner
+// registers the doorbell without eventfds.
+//---------------------------------------------------------------------
+void SharedMemoryDoorbell::Create()
+{
+#ifdef __linux__
+    if (_flags.GetBuffer() != nullptr && _isOwner)
+    {
+        RegisterSharedMemoryRegion(_id, std::vector<int>());
+    }
+#endif
+}
+
+//---------------------------------------------------------------------
+// The owner rings direction 0 and listens on direction 1, the client
+// does the opposite.
+//---------------------------------------------------------------------
+void SharedMemoryDoorbell::Ring()
+{
+#ifdef __linux__
+    auto flags = reinterpret_cast<DoorbellFlags*>(_flags.MappedBuffer());
+    auto direction = _isOwner ? 0 : 1;
+    if (flags != nullptr && flags[direction].armed.load(std::memory_order_relaxed) != 0 && OpenEventFds())
+    {
+        eventfd_write(_eventFds[direction], 1);
+    }
+#endif
+}
+
+//---------------------------------------------------------------------
+// Arms the doorbell for the messages this side reads.  The doorbell is
+// rung once right away because messages may have been published before
+// it was armed.
+//---------------------------------------------------------------------
+int SharedMemoryDoorbell::ReadFd()
+{
+#ifdef __linux__
+    auto flags = reinterpret_cast<DoorbellFlags*>(_flags.MappedBuffer());
+    if (flags == nullptr || !OpenEventFds())
+    {
+        return -1;
+    }
+    auto direction = _isOwner ? 1 : 0;
+    if (flags[direction].armed.exchange(1) == 0)
+    {
+        eventfd_write(_eventFds[direction], 1);
+    }
+    return _eventFds[direction];
+#else
+    return -1;
+#endif
+}
+
+//---------------------------------------------------------------------
+// A shared memory sideband has one area per direction, each starting on
+// its own cache line.  The owner writes to area 0 and reads from area 1,
+// the client does the opposite, so a request and its response never
+// share cache lines.  Each area holds one length prefixed message.
+//---------------------------------------------------------------------
+static int64_t SharedMemoryAreaSize(int64_t bufferSize)
+{
+    auto areaSize = bufferSize + static_cast<int64_t>(sizeof(int64_t));
+    return (areaSize + CacheLineSize - 1) & ~(CacheLineSize - 1);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SharedMemorySidebandData::SharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl) :
+    SidebandData(bufferSize),
+    _usageId(id),
+    _isOwner(isOwner),
+    _bufferSize(bufferSize),
+    _areaSize(SharedMemoryAreaSize(bufferSize)),
+    _region(id, 2 * SharedMemoryAreaSize(bufferSize), isOwner, connectionUrl),
+    _doorbell(id, isOwner, connectionUrl)
+{
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SharedMemorySidebandData::~SharedMemorySidebandData()
+{
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SharedMemorySidebandData* SharedMemorySidebandData::InitNew(int64_t bufferSize)
+{
+    auto sidebandData = new SharedMemorySidebandData(NextSharedMemoryId(), bufferSize, true, std::string());
+    if (sidebandData->_region.GetBuffer() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SharedMemorySidebandData* SharedMemorySidebandData::ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl)
+{
+    auto sidebandData = new SharedMemorySidebandData(id, bufferSize, false, connectionUrl);
+    if (sidebandData->_region.GetBuffer() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const std::string& SharedMemorySidebandData::UsageId()
+{
+    return _usageId;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int SharedMemorySidebandData::GetDoorbell()
+{
+    return _doorbell.ReadFd();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* SharedMemorySidebandData::WriteArea()
+{
+    auto buffer = _region.GetBuffer();
+    if (buffer == nullptr)
+    {
+        return nullptr;
+    }
+    return buffer + (_isOwner ? 0 : _areaSize);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* SharedMemorySidebandData::ReadArea()
+{
+    auto buffer = _region.GetBuffer();
+    if (buffer == nullptr)
+    {
+        return nullptr;
+    }
+    return buffer + (_isOwner ? _areaSize : 0);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SharedMemorySidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::SHARED_MEMORY_PAGE_SIZE:
+            *value = _region.PageSize();
+            return true;
+        case ::SidebandProperty::NUMA_NODE:
+            *value = _region.NumaNode();
+            return true;
+    }
+    return SidebandData::GetProperty(property, value);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SharedMemorySidebandData::Write(const uint8_t* bytes, int64_t bytecount)
+{
+    return WriteLengthPrefixed(bytes, bytecount);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SharedMemorySidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    return ReadFromLengthPrefixed(bytes, bufferSize, numBytesRead);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool SharedMemorySidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
 {
-    auto ptr = GetBuffer();
-    if (!ptr)
+    auto ptr = WriteArea();
+    if (!ptr || byteCount > _bufferSize)
     {
         return false;
     }
     *reinterpret_cast<int64_t*>(ptr) = byteCount;
     ptr += sizeof(int64_t);
     memcpy(ptr, bytes, byteCount);
+    _doorbell.Ring();
     return true;
 }
 
@@ -166,12 +871,18 @@ bool SharedMemorySidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t
 //---------------------------------------------------------------------
 bool SharedMemorySidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
 {
-    auto ptr = GetBuffer() + sizeof(int64_t);
+    auto ptr = ReadArea();
     if (!ptr)
     {
         return false;
     }
-    memcpy(bytes, ptr, bufferSize);
+    auto length = *reinterpret_cast<int64_t*>(ptr);
+    auto count = length < bufferSize ? length : bufferSize;
+    memcpy(bytes, ptr + sizeof(int64_t), count);
+    if (numBytesRead != nullptr)
+    {
+        *numBytesRead = count;
+    }
     return true;
 }
 
@@ -179,7 +890,11 @@ bool SharedMemorySidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bu
 //---------------------------------------------------------------------
 int64_t SharedMemorySidebandData::ReadLengthPrefix()
 {
-    auto ptr = GetBuffer();
+    auto ptr = ReadArea();
+    if (!ptr)
+    {
+        return 0;
+    }
     return *reinterpret_cast<int64_t*>(ptr);
 }
 
@@ -187,14 +902,19 @@ int64_t SharedMemorySidebandData::ReadLengthPrefix()
 //---------------------------------------------------------------------
 const uint8_t* SharedMemorySidebandData::BeginDirectRead(int64_t byteCount)
 {
-    return GetBuffer();
+    auto ptr = ReadArea();
+    if (!ptr)
+    {
+        return nullptr;
+    }
+    return ptr + sizeof(int64_t);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 const uint8_t* SharedMemorySidebandData::BeginDirectReadLengthPrefixed(int64_t* bufferSize)
 {
-    auto ptr = GetBuffer();
+    auto ptr = ReadArea();
     if (!ptr)
     {
         return nullptr;
@@ -214,75 +934,297 @@ bool SharedMemorySidebandData::FinishDirectRead()
 //---------------------------------------------------------------------
 uint8_t* SharedMemorySidebandData::BeginDirectWrite()
 {
-    return GetBuffer();
+    auto ptr = WriteArea();
+    if (!ptr)
+    {
+        return nullptr;
+    }
+    return ptr + sizeof(int64_t);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool SharedMemorySidebandData::FinishDirectWrite(int64_t byteCount)
 {
+    auto ptr = WriteArea();
+    if (!ptr || byteCount > _bufferSize)
+    {
+        return false;
+    }
+    *reinterpret_cast<int64_t*>(ptr) = byteCount;
+    _doorbell.Ring();
     return true;
 }
 
+//---------------------------------------------------------------------
+// The buffer pool is a fixed header region followed by a region of
+// slots, with a separate set of slots for each direction.  The owner
+// writes to direction 0 and reads from direction 1, the client does the
+// opposite.  Every slot starts with its length prefix and is marked free
+// or filled, writers wait for their next slot to be free and readers
+// for their next slot to be filled.  Either side sets closed when it
+// goes away.
+//---------------------------------------------------------------------
+static const uint32_t BufferPoolSlotFree = 0;
+static const uint32_t BufferPoolSlotFilled = 1;
+static const int64_t MaxBufferPoolSlots = 64;
+static const int64_t DefaultBufferPoolSlots = 2;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct BufferPoolSlot
+{
+    alignas(CacheLineSize) std::atomic<uint32_t> state;
+    FutexSignal stateChanged;
+};
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-DoubleBufferedSharedMemorySidebandData::DoubleBufferedSharedMemorySidebandData(const std::string& id, int64_t bufferSize) :
+struct BufferPoolHeader
+{
+    alignas(CacheLineSize) std::atomic<uint32_t> slotCount;
+    std::atomic<uint32_t> closed;
+    BufferPoolSlot slots[2][MaxBufferPoolSlots];
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t BufferPoolSlotSize(int64_t bufferSize)
+{
+    auto slotSize = bufferSize + static_cast<int64_t>(sizeof(int64_t));
+    return (slotSize + CacheLineSize - 1) & ~(CacheLineSize - 1);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+DoubleBufferedSharedMemorySidebandData::DoubleBufferedSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl) :
     SidebandData(bufferSize),
-    _bufferA(id + "_A", bufferSize),
-    _bufferB(id + "_B", bufferSize),
-    _id(id)
+    _id(id),
+    _isOwner(isOwner),
+    _connectionUrl(connectionUrl),
+    _bufferSize(bufferSize),
+    _slotSize(BufferPoolSlotSize(bufferSize)),
+    _slotCount(0),
+    _writeSlot(0),
+    _readSlot(0),
+    _header(id + "_POOL", sizeof(BufferPoolHeader), isOwner, connectionUrl),
+    _doorbell(id, isOwner, connectionUrl)
 {
-    _current = &_bufferA;
+    for (int direction = 0; direction < 2; ++direction)
+    {
+        _slotFreeEvents[direction].Open(id + "_POOL_FREE" + std::to_string(direction));
+        _slotFilledEvents[direction].Open(id + "_POOL_FILLED" + std::to_string(direction));
+    }
 }
 
 //---------------------------------------------------------------------
+// Wakes a peer that is waiting on any slot so it fails instead of
+// waiting for a side that is gone.
 //---------------------------------------------------------------------
 DoubleBufferedSharedMemorySidebandData::~DoubleBufferedSharedMemorySidebandData()
 {
+    auto header = reinterpret_cast<BufferPoolHeader*>(_header.MappedBuffer());
+    if (header == nullptr)
+    {
+        return;
+    }
+    header->closed.store(1);
+    auto slotCount = static_cast<int64_t>(header->slotCount.load());
+    for (int direction = 0; direction < 2; ++direction)
+    {
+        for (int64_t x = 0; x < slotCount && x < MaxBufferPoolSlots; ++x)
+        {
+            header->slots[direction][x].stateChanged.Notify(_slotFreeEvents[direction]);
+            header->slots[direction][x].stateChanged.Notify(_slotFilledEvents[direction]);
+        }
+    }
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 DoubleBufferedSharedMemorySidebandData* DoubleBufferedSharedMemorySidebandData::InitNew(int64_t bufferSize)
 {
-    std::string usageId = "TestBuffer";
-    auto sidebandData = new DoubleBufferedSharedMemorySidebandData(usageId, bufferSize);
+    auto sidebandData = new DoubleBufferedSharedMemorySidebandData(NextSharedMemoryId(), bufferSize, true, std::string());
+    if (sidebandData->Slots() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+DoubleBufferedSharedMemorySidebandData* DoubleBufferedSharedMemorySidebandData::ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl)
+{
+    auto sidebandData = new DoubleBufferedSharedMemorySidebandData(id, bufferSize, false, connectionUrl);
+    if (sidebandData->Slots() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
     return sidebandData;
 }
 
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int DoubleBufferedSharedMemorySidebandData::GetDoorbell()
+{
+    return _doorbell.ReadFd();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+BufferPoolHeader* DoubleBufferedSharedMemorySidebandData::PoolHeader()
+{
+    return reinterpret_cast<BufferPoolHeader*>(_header.GetBuffer());
+}
+
+//---------------------------------------------------------------------
+// The owner picks the slot count, clients use whatever the owner
+// published in the header.
+//---------------------------------------------------------------------
+uint8_t* DoubleBufferedSharedMemorySidebandData::Slots()
+{
+    if (_slots)
+    {
+        return _slots->GetBuffer();
+    }
+    auto header = PoolHeader();
+    if (header == nullptr)
+    {
+        return nullptr;
+    }
+    if (_isOwner || header->slotCount.load() == 0)
+    {
+        auto slotCount = GetSidebandDefaultProperty(::SidebandProperty::SHARED_MEMORY_BUFFER_COUNT, DefaultBufferPoolSlots);
+        if (slotCount < 1 || slotCount > MaxBufferPoolSlots)
+        {
+            std::cout << "Invalid shared memory buffer count " << slotCount << ", using " << DefaultBufferPoolSlots << std::endl;
+            slotCount = DefaultBufferPoolSlots;
+        }
+        header->slotCount.store(static_cast<uint32_t>(slotCount));
+    }
+    _slotCount = header->slotCount.load();
+    _slots.reset(new SharedMemoryRegion(_id + "_SLOTS", 2 * _slotCount * _slotSize, _isOwner, _connectionUrl));
+    return _slots->GetBuffer();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+::SidebandWaitPolicy DoubleBufferedSharedMemorySidebandData::WaitPolicy()
+{
+    if (_waitPolicy == ::SidebandWaitPolicy::DEFAULT)
+    {
+        return ::SidebandWaitPolicy::SPIN_THEN_BLOCK;
+    }
+    return _waitPolicy;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* DoubleBufferedSharedMemorySidebandData::AcquireWriteSlot()
+{
+    auto slots = Slots();
+    if (slots == nullptr)
+    {
+        return nullptr;
+    }
+    auto direction = _isOwner ? 0 : 1;
+    auto header = PoolHeader();
+    if (header->closed.load() != 0)
+    {
+        return nullptr;
+    }
+    auto& slot = header->slots[direction][_writeSlot];
+    auto ready = slot.stateChanged.Wait([&]() {
+        return slot.state.load(std::memory_order_acquire) == BufferPoolSlotFree;
+    }, header->closed, _slotFreeEvents[direction], WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+    if (!ready)
+    {
+        return nullptr;
+    }
+    return slots + (direction * _slotCount + _writeSlot) * _slotSize;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void DoubleBufferedSharedMemorySidebandData::PublishWriteSlot(int64_t byteCount)
+{
+    auto direction = _isOwner ? 0 : 1;
+    auto& slot = PoolHeader()->slots[direction][_writeSlot];
+    *reinterpret_cast<int64_t*>(Slots() + (direction * _slotCount + _writeSlot) * _slotSize) = byteCount;
+    slot.state.store(BufferPoolSlotFilled);
+    slot.stateChanged.Notify(_slotFilledEvents[direction]);
+    _doorbell.Ring();
+    _writeSlot = (_writeSlot + 1) % _slotCount;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* DoubleBufferedSharedMemorySidebandData::AcquireReadSlot()
+{
+    auto slots = Slots();
+    if (slots == nullptr)
+    {
+        return nullptr;
+    }
+    auto direction = _isOwner ? 1 : 0;
+    auto header = PoolHeader();
+    auto& slot = header->slots[direction][_readSlot];
+    auto ready = slot.stateChanged.Wait([&]() {
+        return slot.state.load(std::memory_order_acquire) == BufferPoolSlotFilled;
+    }, header->closed, _slotFilledEvents[direction], WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+    if (!ready)
+    {
+        return nullptr;
+    }
+    return slots + (direction * _slotCount + _readSlot) * _slotSize;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void DoubleBufferedSharedMemorySidebandData::ReleaseReadSlot()
+{
+    auto direction = _isOwner ? 1 : 0;
+    auto& slot = PoolHeader()->slots[direction][_readSlot];
+    slot.state.store(BufferPoolSlotFree);
+    slot.stateChanged.Notify(_slotFreeEvents[direction]);
+    _readSlot = (_readSlot + 1) % _slotCount;
+}
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool DoubleBufferedSharedMemorySidebandData::Write(const uint8_t* bytes, int64_t byteCount)
 {
-    auto result = _current->Write(bytes, byteCount);
-    _current = _current == &_bufferA ? &_bufferB : &_bufferA;
-    return result;
+    return WriteLengthPrefixed(bytes, byteCount);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool DoubleBufferedSharedMemorySidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
 {
-    auto result = _current->Read(bytes, bufferSize, numBytesRead);
-    _current = _current == &_bufferA ? &_bufferB : &_bufferA;
-    return result;
+    return ReadFromLengthPrefixed(bytes, bufferSize, numBytesRead);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool DoubleBufferedSharedMemorySidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
 {
-    auto result = _current->Write(reinterpret_cast<const uint8_t*>(&byteCount), sizeof(int64_t));
-    if (!result)
+    if (byteCount > _bufferSize)
     {
+        std::cout << "Write of " << byteCount << " bytes does not fit in the shared memory buffer" << std::endl;
         return false;
     }
-    result = _current->Write(bytes, byteCount);
-    if (!result)
+    auto slot = AcquireWriteSlot();
+    if (slot == nullptr)
     {
         return false;
     }
-    _current = _current == &_bufferA ? &_bufferB : &_bufferA;
+    memcpy(slot + sizeof(int64_t), bytes, byteCount);
+    PublishWriteSlot(byteCount);
     return true;
 }
 
@@ -290,37 +1232,68 @@ bool DoubleBufferedSharedMemorySidebandData::WriteLengthPrefixed(const uint8_t*
 //---------------------------------------------------------------------
 bool DoubleBufferedSharedMemorySidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
 {
-    auto result = _current->ReadFromLengthPrefixed(bytes, bufferSize, numBytesRead);
-    _current = _current == &_bufferA ? &_bufferB : &_bufferA;
-    return result;
+    auto slot = AcquireReadSlot();
+    if (slot == nullptr)
+    {
+        return false;
+    }
+    auto length = *reinterpret_cast<int64_t*>(slot);
+    auto count = length < bufferSize ? length : bufferSize;
+    memcpy(bytes, slot + sizeof(int64_t), count);
+    if (numBytesRead != nullptr)
+    {
+        *numBytesRead = count;
+    }
+    ReleaseReadSlot();
+    return true;
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 int64_t DoubleBufferedSharedMemorySidebandData::ReadLengthPrefix()
 {
-    return _current->ReadLengthPrefix();
+    auto slot = AcquireReadSlot();
+    if (slot == nullptr)
+    {
+        return 0;
+    }
+    return *reinterpret_cast<int64_t*>(slot);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 const uint8_t* DoubleBufferedSharedMemorySidebandData::BeginDirectRead(int64_t byteCount)
 {
-    return _current->BeginDirectRead(byteCount);
+    auto slot = AcquireReadSlot();
+    if (slot == nullptr)
+    {
+        return nullptr;
+    }
+    return slot + sizeof(int64_t);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 const uint8_t* DoubleBufferedSharedMemorySidebandData::BeginDirectReadLengthPrefixed(int64_t* bufferSize)
 {
-    return _current->BeginDirectReadLengthPrefixed(bufferSize);
+    auto slot = AcquireReadSlot();
+    if (slot == nullptr)
+    {
+        return nullptr;
+    }
+    *bufferSize = *reinterpret_cast<int64_t*>(slot);
+    return slot + sizeof(int64_t);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool DoubleBufferedSharedMemorySidebandData::FinishDirectRead()
 {
-    _current = _current == &_bufferA ? &_bufferB : &_bufferA;
+    if (Slots() == nullptr)
+    {
+        return false;
+    }
+    ReleaseReadSlot();
     return true;
 }
 
@@ -328,14 +1301,23 @@ bool DoubleBufferedSharedMemorySidebandData::FinishDirectRead()
 //---------------------------------------------------------------------
 uint8_t* DoubleBufferedSharedMemorySidebandData::BeginDirectWrite()
 {
-    return _current->BeginDirectWrite();
+    auto slot = AcquireWriteSlot();
+    if (slot == nullptr)
+    {
+        return nullptr;
+    }
+    return slot + sizeof(int64_t);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 bool DoubleBufferedSharedMemorySidebandData::FinishDirectWrite(int64_t byteCount)
 {
-    _current = _current == &_bufferA ? &_bufferB : &_bufferA;
+    if (Slots() == nullptr || byteCount > _bufferSize)
+    {
+        return false;
+    }
+    PublishWriteSlot(byteCount);
     return true;
 }
 
@@ -345,3 +1327,34 @@ const std::string& DoubleBufferedSharedMemorySidebandData::UsageId()
 {
     return _id;
 }
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool DoubleBufferedSharedMemorySidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::SHARED_MEMORY_PAGE_SIZE:
+            if (Slots() == nullptr)
+            {
+                return false;
+            }
+            *value = _slots->PageSize();
+            return true;
+        case ::SidebandProperty::NUMA_NODE:
+            if (Slots() == nullptr)
+            {
+                return false;
+            }
+            *value = _slots->NumaNode();
+            return true;
+        case ::SidebandProperty::SHARED_MEMORY_BUFFER_COUNT:
+            if (Slots() == nullptr)
+            {
+                return false;
+            }
+            *value = _slotCount;
+            return true;
+    }
+    return SidebandData::GetProperty(property, value);
+}
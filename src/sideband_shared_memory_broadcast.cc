@@ -0,0 +1,678 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sideband_data.h>
+#include <sideband_internal.h>
+#include <sideband_futex.h>
+
+#ifndef _WIN32
+#include <signal.h>          // kill
+#include <unistd.h>          // getpid
+#include <errno.h>
+#endif
+
+//---------------------------------------------------------------------
+// A broadcast region is one ring of length prefixed frames written by
+// the owner and read by up to MaxBroadcastReaders clients.  Every reader
+// registers a cursor in the header.  The writer only looks at the
+// cursors when its cached minimum says the ring is full, so publishing a
+// frame does not depend on the number of readers.  The owner sets
+// closed when it goes away.  Each reader also records its process id so
+// the writer can take back the slot of a reader that exited without
+// closing.
+//---------------------------------------------------------------------
+static const int MaxBroadcastReaders = 16;
+static const int64_t BroadcastFrameDepth = 8;
+static const int64_t BroadcastWrapMarker = -1;
+static const int64_t BroadcastReaderCheckMilliseconds = 100;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct BroadcastReader
+{
+    alignas(CacheLineSize) std::atomic<uint32_t> active;
+    std::atomic<uint64_t> cursor;
+    std::atomic<uint64_t> dropped;
+    std::atomic<int64_t> processId;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct BroadcastHeader
+{
+    alignas(CacheLineSize) std::atomic<uint64_t> head;
+    FutexSignal dataAvailable;
+    alignas(CacheLineSize) FutexSignal spaceAvailable;
+    std::atomic<uint32_t> dropLaggards;
+    std::atomic<uint32_t> closed;
+    BroadcastReader readers[MaxBroadcastReaders];
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t CurrentProcessId()
+{
+#ifdef _WIN32
+    return static_cast<int64_t>(GetCurrentProcessId());
+#else
+    return static_cast<int64_t>(getpid());
+#endif
+}
+
+//---------------------------------------------------------------------
+// Only a process that is known to be gone counts as exited, a process
+// of another user that cannot be signaled is still running.
+//---------------------------------------------------------------------
+static bool ProcessHasExited(int64_t processId)
+{
+#ifdef _WIN32
+    auto process = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(processId));
+    if (process == NULL)
+    {
+        return GetLastError() == ERROR_INVALID_PARAMETER;
+    }
+    auto exited = WaitForSingleObject(process, 0) == WAIT_OBJECT_0;
+    CloseHandle(process);
+    return exited;
+#else
+    return kill(static_cast<pid_t>(processId), 0) == -1 && errno == ESRCH;
+#endif
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t AlignBroadcastFrame(int64_t byteCount)
+{
+    auto frameSize = byteCount + static_cast<int64_t>(sizeof(int64_t));
+    return (frameSize + CacheLineSize - 1) & ~(CacheLineSize - 1);
+}
+
+//---------------------------------------------------------------------
+// A dropped reader can see a frame that is being overwritten, never
+// trust the length beyond the buffer size.
+//---------------------------------------------------------------------
+int64_t BroadcastSharedMemorySidebandData::FrameLength(const uint8_t* frame)
+{
+    auto length = *reinterpret_cast<const volatile int64_t*>(frame);
+    if (length < 0 || length > _bufferSize)
+    {
+        return 0;
+    }
+    return length;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+BroadcastSharedMemorySidebandData::BroadcastSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl) :
+    SidebandData(bufferSize),
+    _id(id),
+    _isOwner(isOwner),
+    _bufferSize(bufferSize),
+    _ringSize(BroadcastFrameDepth * AlignBroadcastFrame(bufferSize)),
+    _region(id + "_BROADCAST", sizeof(BroadcastHeader) + BroadcastFrameDepth * AlignBroadcastFrame(bufferSize), isOwner, connectionUrl),
+    _readerIndex(-1),
+    _minimumCursor(0),
+    _readCursor(0),
+    _readFrame(nullptr)
+{
+    _dataAvailableEvent.Open(id + "_BROADCAST_DATA");
+    _spaceAvailableEvent.Open(id + "_BROADCAST_SPACE");
+    if (!_isOwner)
+    {
+        RegisterReader();
+    }
+}
+
+//---------------------------------------------------------------------
+// A reader gives up its slot, the owner wakes all readers so they fail
+// instead of waiting for a writer that is gone.
+//---------------------------------------------------------------------
+BroadcastSharedMemorySidebandData::~BroadcastSharedMemorySidebandData()
+{
+    auto header = reinterpret_cast<BroadcastHeader*>(_region.MappedBuffer());
+    if (header == nullptr)
+    {
+        return;
+    }
+    if (_readerIndex != -1)
+    {
+        header->readers[_readerIndex].processId.store(0);
+        header->readers[_readerIndex].active.store(0);
+        header->spaceAvailable.Notify(_spaceAvailableEvent);
+    }
+    if (_isOwner)
+    {
+        header->closed.store(1);
+        header->dataAvailable.Notify(_dataAvailableEvent);
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+BroadcastSharedMemorySidebandData* BroadcastSharedMemorySidebandData::InitNew(int64_t bufferSize)
+{
+    auto sidebandData = new BroadcastSharedMemorySidebandData(NextSharedMemoryId(), bufferSize, true, std::string());
+    auto header = sidebandData->Header();
+    if (header == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    header->dropLaggards.store(GetSidebandDefaultProperty(::SidebandProperty::BROADCAST_DROP_LAGGARDS, 0) != 0 ? 1 : 0);
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+// A client that cannot map the ring or finds every reader slot taken
+// fails here instead of on its first read.
+//---------------------------------------------------------------------
+BroadcastSharedMemorySidebandData* BroadcastSharedMemorySidebandData::ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl)
+{
+    auto sidebandData = new BroadcastSharedMemorySidebandData(id, bufferSize, false, connectionUrl);
+    if (sidebandData->_readerIndex == -1)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const std::string& BroadcastSharedMemorySidebandData::UsageId()
+{
+    return _id;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::SetProperty(::SidebandProperty property, int64_t value)
+{
+    if (property == ::SidebandProperty::BROADCAST_DROP_LAGGARDS)
+    {
+        auto header = Header();
+        if (!_isOwner || header == nullptr)
+        {
+            return false;
+        }
+        header->dropLaggards.store(value != 0 ? 1 : 0);
+        return true;
+    }
+    return SidebandData::SetProperty(property, value);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::SHARED_MEMORY_PAGE_SIZE:
+            *value = _region.PageSize();
+            return true;
+        case ::SidebandProperty::NUMA_NODE:
+            *value = _region.NumaNode();
+            return true;
+        case ::SidebandProperty::BROADCAST_DROP_LAGGARDS:
+            {
+                auto header = Header();
+                if (header == nullptr)
+                {
+                    return false;
+                }
+                *value = header->dropLaggards.load();
+                return true;
+            }
+        case ::SidebandProperty::BROADCAST_DROPPED:
+            {
+                auto header = Header();
+                if (header == nullptr || _readerIndex == -1)
+                {
+                    return false;
+                }
+                *value = static_cast<int64_t>(header->readers[_readerIndex].dropped.load());
+                return true;
+            }
+    }
+    return SidebandData::GetProperty(property, value);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+::SidebandWaitPolicy BroadcastSharedMemorySidebandData::WaitPolicy()
+{
+    if (_waitPolicy == ::SidebandWaitPolicy::DEFAULT)
+    {
+        return ::SidebandWaitPolicy::SPIN_THEN_BLOCK;
+    }
+    return _waitPolicy;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+BroadcastHeader* BroadcastSharedMemorySidebandData::Header()
+{
+    return reinterpret_cast<BroadcastHeader*>(_region.GetBuffer());
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* BroadcastSharedMemorySidebandData::RingData()
+{
+    return _region.GetBuffer() + sizeof(BroadcastHeader);
+}
+
+//---------------------------------------------------------------------
+// Readers join at the current head, they never see frames published
+// before they registered.  Until the cursor is stored the writer sees
+// the previous reader's cursor, which is behind the head and so only
+// makes it more careful.  A slot is only ever taken back after its
+// process id is cleared, so a reader that has not stored its process id
+// yet is never mistaken for the one that held the slot before.
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::RegisterReader()
+{
+    if (_readerIndex != -1)
+    {
+        return true;
+    }
+    auto header = Header();
+    if (header == nullptr)
+    {
+        return false;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        for (int x = 0; x < MaxBroadcastReaders; ++x)
+        {
+            uint32_t inactive = 0;
+            auto& reader = header->readers[x];
+            if (reader.active.compare_exchange_strong(inactive, 1))
+            {
+                reader.dropped.store(0);
+                reader.cursor.store(header->head.load());
+                reader.processId.store(CurrentProcessId());
+                _readerIndex = x;
+                return true;
+            }
+        }
+        if (!ReclaimExitedReaders())
+        {
+            break;
+        }
+    }
+    std::cout << "Broadcast sideband " << _id << " already has " << MaxBroadcastReaders << " readers" << std::endl;
+    return false;
+}
+
+//---------------------------------------------------------------------
+// Frees the slots of readers whose process exited without closing the
+// sideband, their cursors would otherwise hold back the writer forever.
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::ReclaimExitedReaders()
+{
+    auto header = Header();
+    auto reclaimed = false;
+    for (int x = 0; x < MaxBroadcastReaders; ++x)
+    {
+        auto& reader = header->readers[x];
+        auto processId = reader.processId.load();
+        if (reader.active.load() != 0 && processId != 0 && ProcessHasExited(processId) &&
+            reader.processId.compare_exchange_strong(processId, 0))
+        {
+            std::cout << "Broadcast sideband " << _id << " dropped reader " << x << " of exited process " << processId << std::endl;
+            reader.active.store(0);
+            reclaimed = true;
+        }
+    }
+    return reclaimed;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint64_t BroadcastSharedMemorySidebandData::ScanMinimumCursor(uint64_t head)
+{
+    auto header = Header();
+    auto minimum = head;
+    for (int x = 0; x < MaxBroadcastReaders; ++x)
+    {
+        auto& reader = header->readers[x];
+        if (reader.active.load() != 0)
+        {
+            auto cursor = reader.cursor.load();
+            if (cursor < minimum)
+            {
+                minimum = cursor;
+            }
+        }
+    }
+    return minimum;
+}
+
+//---------------------------------------------------------------------
+// Moves every reader that is holding back the writer to the head.  The
+// reader notices the moved cursor when it releases its frame and drops
+// what it read.
+//---------------------------------------------------------------------
+void BroadcastSharedMemorySidebandData::DropLaggards(uint64_t head, uint64_t needed)
+{
+    auto header = Header();
+    for (int x = 0; x < MaxBroadcastReaders; ++x)
+    {
+        auto& reader = header->readers[x];
+        if (reader.active.load() != 0)
+        {
+            auto cursor = reader.cursor.load();
+            if (cursor < needed && reader.cursor.compare_exchange_strong(cursor, head))
+            {
+                reader.dropped.fetch_add(1);
+            }
+        }
+    }
+    header->dataAvailable.Notify(_dataAvailableEvent);
+}
+
+//---------------------------------------------------------------------
+// Waits in short slices so a reader that exits while the writer is
+// waiting for it is noticed and dropped.
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::WaitForReaders(uint64_t head, uint64_t needed)
+{
+    auto header = Header();
+    auto start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        if (ReclaimExitedReaders())
+        {
+            _minimumCursor = ScanMinimumCursor(head);
+            if (_minimumCursor >= needed)
+            {
+                return true;
+            }
+        }
+        auto slice = BroadcastReaderCheckMilliseconds;
+        if (_waitTimeoutMilliseconds >= 0)
+        {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            if (elapsed >= _waitTimeoutMilliseconds)
+            {
+                return false;
+            }
+            if (_waitTimeoutMilliseconds - elapsed < slice)
+            {
+                slice = _waitTimeoutMilliseconds - elapsed;
+            }
+        }
+        auto ready = header->spaceAvailable.Wait([&]() {
+            _minimumCursor = ScanMinimumCursor(head);
+            return _minimumCursor >= needed;
+        }, header->closed, _spaceAvailableEvent, WaitPolicy(), _spinMicroseconds, slice);
+        if (ready)
+        {
+            return true;
+        }
+        if (header->closed.load() != 0)
+        {
+            return false;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* BroadcastSharedMemorySidebandData::ReserveWriteFrame(int64_t byteCount)
+{
+    if (!_isOwner)
+    {
+        std::cout << "Only the owner can write to a broadcast sideband" << std::endl;
+        return nullptr;
+    }
+    if (byteCount > _bufferSize)
+    {
+        std::cout << "Frame of " << byteCount << " bytes does not fit in the broadcast ring" << std::endl;
+        return nullptr;
+    }
+    auto header = Header();
+    if (header == nullptr)
+    {
+        return nullptr;
+    }
+    auto frameSize = AlignBroadcastFrame(byteCount);
+    auto head = header->head.load(std::memory_order_relaxed);
+    auto offset = static_cast<int64_t>(head % _ringSize);
+    auto padding = offset + frameSize > _ringSize ? _ringSize - offset : 0;
+    // Every cursor must be at or past this position for the frame to fit
+    auto needed = head + padding + frameSize - _ringSize;
+    if (head + padding + frameSize > static_cast<uint64_t>(_ringSize) && _minimumCursor < needed)
+    {
+        _minimumCursor = ScanMinimumCursor(head);
+        if (_minimumCursor < needed)
+        {
+            if (header->dropLaggards.load() != 0)
+            {
+                DropLaggards(head, needed);
+                _minimumCursor = ScanMinimumCursor(head);
+            }
+            else if (!WaitForReaders(head, needed))
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    if (padding != 0)
+    {
+        *reinterpret_cast<int64_t*>(RingData() + offset) = BroadcastWrapMarker;
+        header->head.store(head + padding);
+        offset = 0;
+    }
+    return RingData() + offset;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void BroadcastSharedMemorySidebandData::PublishWriteFrame(int64_t byteCount)
+{
+    auto header = Header();
+    auto head = header->head.load(std::memory_order_relaxed);
+    *reinterpret_cast<int64_t*>(RingData() + head % _ringSize) = byteCount;
+    header->head.store(head + AlignBroadcastFrame(byteCount));
+    header->dataAvailable.Notify(_dataAvailableEvent);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* BroadcastSharedMemorySidebandData::AcquireReadFrame()
+{
+    if (_readFrame != nullptr)
+    {
+        return _readFrame;
+    }
+    if (_isOwner)
+    {
+        std::cout << "The owner of a broadcast sideband cannot read from it" << std::endl;
+        return nullptr;
+    }
+    if (!RegisterReader())
+    {
+        return nullptr;
+    }
+    auto header = Header();
+    auto& reader = header->readers[_readerIndex];
+    while (true)
+    {
+        auto cursor = reader.cursor.load();
+        auto ready = header->dataAvailable.Wait([&]() {
+            return header->head.load(std::memory_order_acquire) != reader.cursor.load();
+        }, header->closed, _dataAvailableEvent, WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+        if (!ready)
+        {
+            return nullptr;
+        }
+        if (reader.cursor.load() != cursor)
+        {
+            continue;
+        }
+
+        auto offset = static_cast<int64_t>(cursor % _ringSize);
+        auto frame = RingData() + offset;
+        if (*reinterpret_cast<int64_t*>(frame) == BroadcastWrapMarker)
+        {
+            if (reader.cursor.compare_exchange_strong(cursor, cursor + (_ringSize - offset)))
+            {
+                header->spaceAvailable.Notify(_spaceAvailableEvent);
+            }
+            continue;
+        }
+        _readCursor = cursor;
+        _readFrame = frame;
+        return _readFrame;
+    }
+}
+
+//---------------------------------------------------------------------
+// Returns false if the writer dropped this reader while it held the
+// frame, the frame may have been overwritten.
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::ReleaseReadFrame()
+{
+    if (_readFrame == nullptr)
+    {
+        return false;
+    }
+    auto header = Header();
+    auto next = _readCursor + AlignBroadcastFrame(FrameLength(_readFrame));
+    _readFrame = nullptr;
+    auto cursor = _readCursor;
+    if (!header->readers[_readerIndex].cursor.compare_exchange_strong(cursor, next))
+    {
+        return false;
+    }
+    header->spaceAvailable.Notify(_spaceAvailableEvent);
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::Write(const uint8_t* bytes, int64_t byteCount)
+{
+    return WriteLengthPrefixed(bytes, byteCount);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    return ReadFromLengthPrefixed(bytes, bufferSize, numBytesRead);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
+{
+    auto frame = ReserveWriteFrame(byteCount);
+    if (frame == nullptr)
+    {
+        return false;
+    }
+    memcpy(frame + sizeof(int64_t), bytes, byteCount);
+    PublishWriteFrame(byteCount);
+    return true;
+}
+
+//---------------------------------------------------------------------
+// A reader that was dropped while copying skips to the next frame it
+// can read consistently.
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    while (true)
+    {
+        auto frame = AcquireReadFrame();
+        if (frame == nullptr)
+        {
+            return false;
+        }
+        auto length = FrameLength(frame);
+        auto count = length < bufferSize ? length : bufferSize;
+        memcpy(bytes, frame + sizeof(int64_t), count);
+        if (ReleaseReadFrame())
+        {
+            if (numBytesRead != nullptr)
+            {
+                *numBytesRead = count;
+            }
+            return true;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t BroadcastSharedMemorySidebandData::ReadLengthPrefix()
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return 0;
+    }
+    return FrameLength(frame);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* BroadcastSharedMemorySidebandData::BeginDirectRead(int64_t byteCount)
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* BroadcastSharedMemorySidebandData::BeginDirectReadLengthPrefixed(int64_t* bufferSize)
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    *bufferSize = FrameLength(frame);
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::FinishDirectRead()
+{
+    return ReleaseReadFrame();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* BroadcastSharedMemorySidebandData::BeginDirectWrite()
+{
+    auto frame = ReserveWriteFrame(_bufferSize);
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool BroadcastSharedMemorySidebandData::FinishDirectWrite(int64_t byteCount)
+{
+    if (!_isOwner || byteCount > _bufferSize)
+    {
+        return false;
+    }
+    PublishWriteFrame(byteCount);
+    return true;
+}
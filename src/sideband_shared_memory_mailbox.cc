@@ -0,0 +1,374 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <cstring>
+#include <iostream>
+#include <sideband_data.h>
+#include <sideband_internal.h>
+#include <sideband_futex.h>
+
+//---------------------------------------------------------------------
+// Each direction of the mailbox holds only the latest frame, guarded by
+// a sequence lock.  The writer makes the sequence odd while it updates
+// the frame and even again when it is done, it never waits for readers.
+// Readers copy the frame and retry if the sequence moved underneath
+// them.  Either side sets closed in both mailboxes when it goes away.
+//---------------------------------------------------------------------
+struct MailboxHeader
+{
+    alignas(CacheLineSize) std::atomic<uint64_t> sequence;
+    FutexSignal published;
+    std::atomic<uint32_t> closed;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t MailboxFrameSize(int64_t bufferSize)
+{
+    auto frameSize = bufferSize + static_cast<int64_t>(sizeof(int64_t));
+    return (frameSize + CacheLineSize - 1) & ~(CacheLineSize - 1);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+MailboxSharedMemorySidebandData::MailboxSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl) :
+    SidebandData(bufferSize),
+    _id(id),
+    _isOwner(isOwner),
+    _bufferSize(bufferSize),
+    _frameSize(MailboxFrameSize(bufferSize)),
+    _region(id + "_MAILBOX", 2 * (sizeof(MailboxHeader) + MailboxFrameSize(bufferSize)), isOwner, connectionUrl),
+    _lastReadSequence(0),
+    _writeSequence(0),
+    _doorbell(id, isOwner, connectionUrl)
+{
+    for (int direction = 0; direction < 2; ++direction)
+    {
+        _publishedEvents[direction].Open(id + "_MAILBOX_PUBLISHED" + std::to_string(direction));
+    }
+}
+
+//---------------------------------------------------------------------
+// Wakes a peer that is waiting for a new value so it fails instead of
+// waiting for a side that is gone.
+//---------------------------------------------------------------------
+MailboxSharedMemorySidebandData::~MailboxSharedMemorySidebandData()
+{
+    if (_region.MappedBuffer() == nullptr)
+    {
+        return;
+    }
+    for (int direction = 0; direction < 2; ++direction)
+    {
+        auto header = MailboxHeaderFor(direction);
+        header->closed.store(1);
+        header->published.Notify(_publishedEvents[direction]);
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+MailboxSharedMemorySidebandData* MailboxSharedMemorySidebandData::InitNew(int64_t bufferSize)
+{
+    auto sidebandData = new MailboxSharedMemorySidebandData(NextSharedMemoryId(), bufferSize, true, std::string());
+    if (sidebandData->_region.GetBuffer() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+MailboxSharedMemorySidebandData* MailboxSharedMemorySidebandData::ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl)
+{
+    auto sidebandData = new MailboxSharedMemorySidebandData(id, bufferSize, false, connectionUrl);
+    if (sidebandData->_region.GetBuffer() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const std::string& MailboxSharedMemorySidebandData::UsageId()
+{
+    return _id;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::SHARED_MEMORY_PAGE_SIZE:
+            *value = _region.PageSize();
+            return true;
+        case ::SidebandProperty::NUMA_NODE:
+            *value = _region.NumaNode();
+            return true;
+        case ::SidebandProperty::LATEST_VALUE_SEQUENCE:
+            {
+                auto header = MailboxHeaderFor(_isOwner ? 1 : 0);
+                if (header == nullptr)
+                {
+                    return false;
+                }
+                *value = static_cast<int64_t>(header->sequence.load(std::memory_order_acquire) / 2);
+                return true;
+            }
+    }
+    return SidebandData::GetProperty(property, value);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int MailboxSharedMemorySidebandData::GetDoorbell()
+{
+    return _doorbell.ReadFd();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+::SidebandWaitPolicy MailboxSharedMemorySidebandData::WaitPolicy()
+{
+    if (_waitPolicy == ::SidebandWaitPolicy::DEFAULT)
+    {
+        return ::SidebandWaitPolicy::SPIN_THEN_BLOCK;
+    }
+    return _waitPolicy;
+}
+
+//---------------------------------------------------------------------
+// The owner writes to mailbox 0 and reads from mailbox 1, the client
+// does the opposite.
+//---------------------------------------------------------------------
+MailboxHeader* MailboxSharedMemorySidebandData::MailboxHeaderFor(int direction)
+{
+    auto buffer = _region.GetBuffer();
+    if (buffer == nullptr)
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<MailboxHeader*>(buffer + direction * (sizeof(MailboxHeader) + _frameSize));
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* MailboxSharedMemorySidebandData::MailboxFrame(int direction)
+{
+    return reinterpret_cast<uint8_t*>(MailboxHeaderFor(direction)) + sizeof(MailboxHeader);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* MailboxSharedMemorySidebandData::BeginPublish()
+{
+    auto header = MailboxHeaderFor(_isOwner ? 0 : 1);
+    if (header == nullptr || header->closed.load() != 0)
+    {
+        return nullptr;
+    }
+    if ((_writeSequence & 1) == 0)
+    {
+        _writeSequence = header->sequence.load(std::memory_order_relaxed) + 1;
+        header->sequence.store(_writeSequence, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    return MailboxFrame(_isOwner ? 0 : 1);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void MailboxSharedMemorySidebandData::FinishPublish(int64_t byteCount)
+{
+    auto direction = _isOwner ? 0 : 1;
+    auto header = MailboxHeaderFor(direction);
+    *reinterpret_cast<int64_t*>(MailboxFrame(direction)) = byteCount;
+    _writeSequence += 1;
+    header->sequence.store(_writeSequence, std::memory_order_release);
+    header->published.Notify(_publishedEvents[direction]);
+    _doorbell.Ring();
+}
+
+//---------------------------------------------------------------------
+// Waits for a frame newer than the last one this side read and copies
+// it into the local snapshot.
+//---------------------------------------------------------------------
+uint8_t* MailboxSharedMemorySidebandData::ReadSnapshot()
+{
+    auto direction = _isOwner ? 1 : 0;
+    auto header = MailboxHeaderFor(direction);
+    if (header == nullptr)
+    {
+        return nullptr;
+    }
+    if (_snapshot.size() == 0)
+    {
+        _snapshot.resize(_frameSize);
+    }
+    auto frame = MailboxFrame(direction);
+    while (true)
+    {
+        auto ready = header->published.Wait([&]() {
+            auto sequence = header->sequence.load(std::memory_order_acquire);
+            return (sequence & 1) == 0 && sequence != _lastReadSequence;
+        }, header->closed, _publishedEvents[direction], WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+        if (!ready)
+        {
+            return nullptr;
+        }
+
+        auto sequence = header->sequence.load(std::memory_order_acquire);
+        auto length = *reinterpret_cast<volatile int64_t*>(frame);
+        if (length >= 0 && length <= _bufferSize)
+        {
+            memcpy(_snapshot.data(), frame, sizeof(int64_t) + length);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((sequence & 1) == 0 && header->sequence.load(std::memory_order_relaxed) == sequence)
+        {
+            _lastReadSequence = sequence;
+            return _snapshot.data();
+        }
+        SidebandCpuPause();
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::Write(const uint8_t* bytes, int64_t byteCount)
+{
+    return WriteLengthPrefixed(bytes, byteCount);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    return ReadFromLengthPrefixed(bytes, bufferSize, numBytesRead);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
+{
+    if (byteCount > _bufferSize)
+    {
+        std::cout << "Frame of " << byteCount << " bytes does not fit in the mailbox" << std::endl;
+        return false;
+    }
+    auto frame = BeginPublish();
+    if (frame == nullptr)
+    {
+        return false;
+    }
+    memcpy(frame + sizeof(int64_t), bytes, byteCount);
+    FinishPublish(byteCount);
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    auto snapshot = ReadSnapshot();
+    if (snapshot == nullptr)
+    {
+        return false;
+    }
+    auto length = *reinterpret_cast<int64_t*>(snapshot);
+    auto count = length < bufferSize ? length : bufferSize;
+    memcpy(bytes, snapshot + sizeof(int64_t), count);
+    if (numBytesRead != nullptr)
+    {
+        *numBytesRead = count;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+// The length of the latest frame, the frame itself is read by the next
+// read call and may be newer by then.
+//---------------------------------------------------------------------
+int64_t MailboxSharedMemorySidebandData::ReadLengthPrefix()
+{
+    auto direction = _isOwner ? 1 : 0;
+    auto header = MailboxHeaderFor(direction);
+    if (header == nullptr)
+    {
+        return 0;
+    }
+    auto ready = header->published.Wait([&]() {
+        auto sequence = header->sequence.load(std::memory_order_acquire);
+        return (sequence & 1) == 0 && sequence != _lastReadSequence;
+    }, header->closed, _publishedEvents[direction], WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+    if (!ready)
+    {
+        return 0;
+    }
+    return *reinterpret_cast<volatile int64_t*>(MailboxFrame(direction));
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* MailboxSharedMemorySidebandData::BeginDirectRead(int64_t byteCount)
+{
+    auto snapshot = ReadSnapshot();
+    if (snapshot == nullptr)
+    {
+        return nullptr;
+    }
+    return snapshot + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* MailboxSharedMemorySidebandData::BeginDirectReadLengthPrefixed(int64_t* bufferSize)
+{
+    auto snapshot = ReadSnapshot();
+    if (snapshot == nullptr)
+    {
+        return nullptr;
+    }
+    *bufferSize = *reinterpret_cast<int64_t*>(snapshot);
+    return snapshot + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::FinishDirectRead()
+{
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Readers retry while a direct write is in progress, so callers should
+// serialize straight into the frame and finish promptly.
+//---------------------------------------------------------------------
+uint8_t* MailboxSharedMemorySidebandData::BeginDirectWrite()
+{
+    auto frame = BeginPublish();
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool MailboxSharedMemorySidebandData::FinishDirectWrite(int64_t byteCount)
+{
+    if ((_writeSequence & 1) == 0 || byteCount > _bufferSize)
+    {
+        return false;
+    }
+    FinishPublish(byteCount);
+    return true;
+}
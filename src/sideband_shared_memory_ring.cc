@@ -0,0 +1,387 @@
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+#include <cstring>
+#include <iostream>
+#include <sideband_data.h>
+#include <sideband_internal.h>
+#include <sideband_futex.h>
+
+//---------------------------------------------------------------------
+// Each direction of the ring is a single producer / single consumer
+// queue of length prefixed frames.  The producer owns head and the
+// consumer owns tail, each on its own cache line so the two sides never
+// write to the same line.  Positions increase monotonically and are
+// wrapped with the ring size when used as offsets.  Either side sets
+// closed in both rings when it goes away.
+//---------------------------------------------------------------------
+struct RingBufferHeader
+{
+    alignas(CacheLineSize) std::atomic<uint64_t> head;
+    FutexSignal dataAvailable;
+    alignas(CacheLineSize) std::atomic<uint64_t> tail;
+    FutexSignal spaceAvailable;
+    alignas(CacheLineSize) std::atomic<uint32_t> closed;
+};
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t RingWrapMarker = -1;
+static const int64_t RingFrameDepth = 4;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int64_t AlignFrame(int64_t byteCount)
+{
+    auto frameSize = byteCount + static_cast<int64_t>(sizeof(int64_t));
+    return (frameSize + CacheLineSize - 1) & ~(CacheLineSize - 1);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+RingBufferSharedMemorySidebandData::RingBufferSharedMemorySidebandData(const std::string& id, int64_t bufferSize, bool isOwner, const std::string& connectionUrl) :
+    SidebandData(bufferSize),
+    _id(id),
+    _isOwner(isOwner),
+    _bufferSize(bufferSize),
+    _ringSize(RingFrameDepth * AlignFrame(bufferSize)),
+    _region(id + "_RING", 2 * (sizeof(RingBufferHeader) + _ringSize), isOwner, connectionUrl),
+    _readFrame(nullptr),
+    _doorbell(id, isOwner, connectionUrl)
+{
+    for (int direction = 0; direction < 2; ++direction)
+    {
+        _dataAvailableEvents[direction].Open(id + "_RING_DATA" + std::to_string(direction));
+        _spaceAvailableEvents[direction].Open(id + "_RING_SPACE" + std::to_string(direction));
+    }
+}
+
+//---------------------------------------------------------------------
+// Wakes a peer that is waiting on either ring so it fails instead of
+// waiting for a side that is gone.
+//---------------------------------------------------------------------
+RingBufferSharedMemorySidebandData::~RingBufferSharedMemorySidebandData()
+{
+    if (_region.MappedBuffer() == nullptr)
+    {
+        return;
+    }
+    for (int direction = 0; direction < 2; ++direction)
+    {
+        auto header = RingHeader(direction);
+        header->closed.store(1);
+        header->dataAvailable.Notify(_dataAvailableEvents[direction]);
+        header->spaceAvailable.Notify(_spaceAvailableEvents[direction]);
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+RingBufferSharedMemorySidebandData* RingBufferSharedMemorySidebandData::InitNew(int64_t bufferSize)
+{
+    auto sidebandData = new RingBufferSharedMemorySidebandData(NextSharedMemoryId(), bufferSize, true, std::string());
+    if (sidebandData->_region.GetBuffer() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+RingBufferSharedMemorySidebandData* RingBufferSharedMemorySidebandData::ClientInit(const std::string& id, int64_t bufferSize, const std::string& connectionUrl)
+{
+    auto sidebandData = new RingBufferSharedMemorySidebandData(id, bufferSize, false, connectionUrl);
+    if (sidebandData->_region.GetBuffer() == nullptr)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_doorbell.Create();
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const std::string& RingBufferSharedMemorySidebandData::UsageId()
+{
+    return _id;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::GetProperty(::SidebandProperty property, int64_t* value)
+{
+    switch (property)
+    {
+        case ::SidebandProperty::SHARED_MEMORY_PAGE_SIZE:
+            *value = _region.PageSize();
+            return true;
+        case ::SidebandProperty::NUMA_NODE:
+            *value = _region.NumaNode();
+            return true;
+    }
+    return SidebandData::GetProperty(property, value);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int RingBufferSharedMemorySidebandData::GetDoorbell()
+{
+    return _doorbell.ReadFd();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+::SidebandWaitPolicy RingBufferSharedMemorySidebandData::WaitPolicy()
+{
+    if (_waitPolicy == ::SidebandWaitPolicy::DEFAULT)
+    {
+        return ::SidebandWaitPolicy::SPIN_THEN_BLOCK;
+    }
+    return _waitPolicy;
+}
+
+//---------------------------------------------------------------------
+// The owner writes to ring 0 and reads from ring 1, the client does the
+// opposite.
+//---------------------------------------------------------------------
+RingBufferHeader* RingBufferSharedMemorySidebandData::RingHeader(int direction)
+{
+    auto buffer = _region.GetBuffer();
+    if (buffer == nullptr)
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<RingBufferHeader*>(buffer + direction * (sizeof(RingBufferHeader) + _ringSize));
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* RingBufferSharedMemorySidebandData::RingData(int direction)
+{
+    return reinterpret_cast<uint8_t*>(RingHeader(direction)) + sizeof(RingBufferHeader);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* RingBufferSharedMemorySidebandData::ReserveWriteFrame(int64_t byteCount)
+{
+    if (byteCount > _bufferSize)
+    {
+        std::cout << "Frame of " << byteCount << " bytes does not fit in the ring buffer" << std::endl;
+        return nullptr;
+    }
+    auto direction = _isOwner ? 0 : 1;
+    auto header = RingHeader(direction);
+    if (header == nullptr || header->closed.load() != 0)
+    {
+        return nullptr;
+    }
+    auto frameSize = AlignFrame(byteCount);
+    auto head = header->head.load(std::memory_order_relaxed);
+    auto offset = static_cast<int64_t>(head % _ringSize);
+    auto padding = offset + frameSize > _ringSize ? _ringSize - offset : 0;
+    auto ready = header->spaceAvailable.Wait([&]() {
+        return _ringSize - static_cast<int64_t>(head - header->tail.load(std::memory_order_acquire)) >= padding + frameSize;
+    }, header->closed, _spaceAvailableEvents[direction], WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+    if (!ready)
+    {
+        return nullptr;
+    }
+
+    if (padding != 0)
+    {
+        // Not enough contiguous space before the end of the ring, mark the
+        // rest of it as unused so the reader skips to the start.
+        *reinterpret_cast<int64_t*>(RingData(direction) + offset) = RingWrapMarker;
+        header->head.store(head + padding);
+        offset = 0;
+    }
+    return RingData(direction) + offset;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void RingBufferSharedMemorySidebandData::PublishWriteFrame(int64_t byteCount)
+{
+    auto direction = _isOwner ? 0 : 1;
+    auto header = RingHeader(direction);
+    auto head = header->head.load(std::memory_order_relaxed);
+    *reinterpret_cast<int64_t*>(RingData(direction) + head % _ringSize) = byteCount;
+    header->head.store(head + AlignFrame(byteCount));
+    header->dataAvailable.Notify(_dataAvailableEvents[direction]);
+    _doorbell.Ring();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* RingBufferSharedMemorySidebandData::AcquireReadFrame()
+{
+    if (_readFrame != nullptr)
+    {
+        return _readFrame;
+    }
+    auto direction = _isOwner ? 1 : 0;
+    auto header = RingHeader(direction);
+    if (header == nullptr)
+    {
+        return nullptr;
+    }
+    while (true)
+    {
+        auto tail = header->tail.load(std::memory_order_relaxed);
+        auto ready = header->dataAvailable.Wait([&]() {
+            return header->head.load(std::memory_order_acquire) != tail;
+        }, header->closed, _dataAvailableEvents[direction], WaitPolicy(), _spinMicroseconds, _waitTimeoutMilliseconds);
+        if (!ready)
+        {
+            return nullptr;
+        }
+
+        auto offset = static_cast<int64_t>(tail % _ringSize);
+        auto frame = RingData(direction) + offset;
+        if (*reinterpret_cast<int64_t*>(frame) == RingWrapMarker)
+        {
+            header->tail.store(tail + (_ringSize - offset));
+            header->spaceAvailable.Notify(_spaceAvailableEvents[direction]);
+            continue;
+        }
+        _readFrame = frame;
+        return _readFrame;
+    }
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void RingBufferSharedMemorySidebandData::ReleaseReadFrame()
+{
+    if (_readFrame == nullptr)
+    {
+        return;
+    }
+    auto direction = _isOwner ? 1 : 0;
+    auto header = RingHeader(direction);
+    auto tail = header->tail.load(std::memory_order_relaxed);
+    header->tail.store(tail + AlignFrame(*reinterpret_cast<int64_t*>(_readFrame)));
+    header->spaceAvailable.Notify(_spaceAvailableEvents[direction]);
+    _readFrame = nullptr;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::Write(const uint8_t* bytes, int64_t byteCount)
+{
+    return WriteLengthPrefixed(bytes, byteCount);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    return ReadFromLengthPrefixed(bytes, bufferSize, numBytesRead);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
+{
+    auto frame = ReserveWriteFrame(byteCount);
+    if (frame == nullptr)
+    {
+        return false;
+    }
+    memcpy(frame + sizeof(int64_t), bytes, byteCount);
+    PublishWriteFrame(byteCount);
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return false;
+    }
+    auto length = *reinterpret_cast<int64_t*>(frame);
+    auto count = length < bufferSize ? length : bufferSize;
+    memcpy(bytes, frame + sizeof(int64_t), count);
+    if (numBytesRead != nullptr)
+    {
+        *numBytesRead = count;
+    }
+    ReleaseReadFrame();
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t RingBufferSharedMemorySidebandData::ReadLengthPrefix()
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return 0;
+    }
+    return *reinterpret_cast<int64_t*>(frame);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* RingBufferSharedMemorySidebandData::BeginDirectRead(int64_t byteCount)
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* RingBufferSharedMemorySidebandData::BeginDirectReadLengthPrefixed(int64_t* bufferSize)
+{
+    auto frame = AcquireReadFrame();
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    *bufferSize = *reinterpret_cast<int64_t*>(frame);
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::FinishDirectRead()
+{
+    ReleaseReadFrame();
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+uint8_t* RingBufferSharedMemorySidebandData::BeginDirectWrite()
+{
+    auto frame = ReserveWriteFrame(_bufferSize);
+    if (frame == nullptr)
+    {
+        return nullptr;
+    }
+    return frame + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool RingBufferSharedMemorySidebandData::FinishDirectWrite(int64_t byteCount)
+{
+    if (byteCount > _bufferSize)
+    {
+        return false;
+    }
+    PublishWriteFrame(byteCount);
+    return true;
+}
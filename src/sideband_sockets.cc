@@ -1,24 +1,46 @@
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 #include <sstream>
+#include <fstream>
 #include <iostream>
 #include <cassert>
 #include <sys/types.h> 
 #include <cstring>
+#include <cstddef>
+#include <cstdio>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #endif
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/vm_sockets.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
 
 #include <sideband_data.h>
 #include <sideband_internal.h>
+#include <sideband_futex.h>
+#include <sideband_io_uring.h>
+#include <sideband_compression.h>
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
@@ -32,17 +54,73 @@
 #define SOCKET_ERROR -1
 #endif
 
+#ifdef __linux__
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
+
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 static std::string s_SidebandSocketsAddress;
 static int s_SidebandSocketsPort;
+static std::string s_SidebandUnixSocketsPath;
+static int s_SidebandHypervisorSocketsPort;
+
+//---------------------------------------------------------------------
+// Largest record written to a SOCK_SEQPACKET socket in one send, larger
+// writes are split.  Has to fit in the default socket send buffer.
+//---------------------------------------------------------------------
+static const int64_t UnixSocketMaxRecord = 65536;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int MaxSocketBuffers = 4;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t DefaultBusyPollMicroseconds = 50;
+static const int64_t MinimumHypervisorSocketBufferSize = 4 * 1024 * 1024;
+static const int64_t DefaultReadAheadBytes = 65536;
+
+//---------------------------------------------------------------------
+// Kernel buffers sized automatically cover the link at 25 Gb/s for the
+// measured round trip, up to MaxAutoSocketBufferSize.
+//---------------------------------------------------------------------
+static const int64_t DefaultLinkBytesPerSecond = 3125000000;
+static const int64_t MaxAutoSocketBufferSize = 64 * 1024 * 1024;
+
+//---------------------------------------------------------------------
+// Frames of SOCKETS_STRIPED sidebands smaller than MinimumStripedBytes
+// go over the first connection only.
+//---------------------------------------------------------------------
+static const int64_t DefaultStripes = 4;
+static const int64_t MaxStripes = 64;
+static const int64_t MinimumStripedBytes = 256 * 1024;
+
+//---------------------------------------------------------------------
+// Set in the length prefix of a frame whose payload is compressed, the
+// rest of the prefix is the payload size.
+//---------------------------------------------------------------------
+static const int64_t CompressedFrame = static_cast<int64_t>(1) << 62;
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-Semaphore SocketSidebandData::_connectQueue;
-bool SocketSidebandData::_nextConnectLowLatency;
-int64_t SocketSidebandData::_nextConnectBufferSize;
-std::string SocketSidebandData::_nextConnectionId;
+std::mutex SocketSidebandData::_connectMutex;
+std::map<std::string, PendingSocketConnection> SocketSidebandData::_pendingConnections;
+std::map<std::string, SocketSidebandData*> SocketSidebandData::_stripedConnections;
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
@@ -50,8 +128,36 @@ SocketSidebandData::SocketSidebandData(const std::string& id, int64_t bufferSize
     SidebandData(bufferSize),
     _socket(INVALID_SOCKET),
     _id(id),
-    _lowLatency(lowLatency)
+    _lowLatency(lowLatency),
+    _messageBoundaries(false),
+    _hypervisorSocket(false),
+    _quickAck(false),
+    _recordOffset(0),
+    _recordLength(0),
+    _sendCalls(0),
+    _receiveCalls(0),
+    _bufferSize(bufferSize),
+    _zeroCopyEnabled(false),
+    _zeroCopySends(0),
+    _zeroCopyCompleted(0),
+    _zeroCopyCopied(0),
+    _sendBuffer(0),
+    _receiveBuffer(nullptr),
+    _receiveBufferSize(0),
+    _decompressed(nullptr),
+    _decompressedLength(0),
+    _stripeCount(0)
 {
+    _zeroCopyThreshold = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_ZEROCOPY_THRESHOLD, 0);
+    _ioUringMode = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_IO_URING, 0);
+    _readAheadSize = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_READ_AHEAD_BYTES, DefaultReadAheadBytes);
+    auto compression = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_COMPRESSION, CompressionOff);
+    if (compression != CompressionOff)
+    {
+        Compression()->SetMode(compression);
+    }
+    _sendBuffers[0] = _sendBuffers[1] = nullptr;
+    _sendBufferSends[0] = _sendBufferSends[1] = 0;
 }
 
 //---------------------------------------------------------------------
@@ -59,19 +165,64 @@ SocketSidebandData::SocketSidebandData(const std::string& id, int64_t bufferSize
 SocketSidebandData::SocketSidebandData(uint64_t socket, int64_t bufferSize, bool lowLatency) :
     SidebandData(bufferSize),
     _socket(socket),
-    _lowLatency(lowLatency)
+    _lowLatency(lowLatency),
+    _messageBoundaries(false),
+    _hypervisorSocket(false),
+    _quickAck(false),
+    _recordOffset(0),
+    _recordLength(0),
+    _sendCalls(0),
+    _receiveCalls(0),
+    _bufferSize(bufferSize),
+    _zeroCopyEnabled(false),
+    _zeroCopySends(0),
+    _zeroCopyCompleted(0),
+    _zeroCopyCopied(0),
+    _sendBuffer(0),
+    _receiveBuffer(nullptr),
+    _receiveBufferSize(0),
+    _decompressed(nullptr),
+    _decompressedLength(0),
+    _stripeCount(0)
 {
+    _zeroCopyThreshold = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_ZEROCOPY_THRESHOLD, 0);
+    _ioUringMode = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_IO_URING, 0);
+    _readAheadSize = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_READ_AHEAD_BYTES, DefaultReadAheadBytes);
+    auto compression = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_COMPRESSION, CompressionOff);
+    if (compression != CompressionOff)
+    {
+        Compression()->SetMode(compression);
+    }
+    _sendBuffers[0] = _sendBuffers[1] = nullptr;
+    _sendBufferSends[0] = _sendBufferSends[1] = 0;
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
 SocketSidebandData::~SocketSidebandData()
 {    
+    if (_stripeCount > 1)
+    {
+        std::unique_lock<std::mutex> lock(_connectMutex);
+        auto striped = _stripedConnections.find(_id);
+        if (striped != _stripedConnections.end() && striped->second == this)
+        {
+            _stripedConnections.erase(striped);
+        }
+    }
+    _stripes.clear();
+    _ioUring.reset();
+    if (_socket != INVALID_SOCKET)
+    {
 #ifdef _WIN32
-    closesocket(_socket);
+        closesocket(_socket);
 #else
-    close(_socket);
+        close(_socket);
 #endif
+    }
+    FreeNumaBuffer(_sendBuffers[0], _bufferSize + sizeof(int64_t));
+    FreeNumaBuffer(_sendBuffers[1], _bufferSize + sizeof(int64_t));
+    FreeNumaBuffer(_receiveBuffer, _receiveBufferSize);
 }
 
 //---------------------------------------------------------------------
@@ -87,309 +238,2291 @@ int GetSocketError()
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-void SocketSidebandData::ConnectToSocket(std::string address, std::string port, std::string usageId, bool lowLatency)
+static bool IsValidSocket(SOCKET socket)
 {
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    struct addrinfo* resultAddress = nullptr;
-    auto result = getaddrinfo(address.c_str(), port.c_str(), &hints, &resultAddress);
-    if (result != 0)
-    {
-        std::cout << "getaddrinfo failed with error: " << result << std::endl;
-        return;
-    }
-    for (addrinfo* current = resultAddress; current != nullptr; current = current->ai_next)
-    {
-        _socket = socket(current->ai_family, SOCK_STREAM, IPPROTO_TCP);
-        if (_socket == INVALID_SOCKET)
-        {
-            std::cout << "socket failed with error: " << GetSocketError() << std::endl;
-            return;
-        }
-        result = connect(_socket, current->ai_addr, (int)current->ai_addrlen);
-        if (result == SOCKET_ERROR)
-        {
 #ifdef _WIN32
-            closesocket(_socket);
+    return socket != INVALID_SOCKET;
 #else
-            close(_socket);
+    return socket >= 0;
 #endif
-            _socket = INVALID_SOCKET;
-            continue;
-        }
-        break;
-    }
-    freeaddrinfo(resultAddress);
-    if (_socket == INVALID_SOCKET)
-    {
-        std::cout << "Unable to connect to server!" << std::endl;
-        return;
-    }
+}
 
-    if (lowLatency)
-    {
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static void CloseSocket(SOCKET socket)
+{
 #ifdef _WIN32
-        u_long iMode = 1;
-        ioctlsocket(_socket, FIONBIO, &iMode);
+    closesocket(socket);
+#else
+    close(socket);
 #endif
-        int yes = 1;
-        int result = setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(int));
-    }
-
-    // Tell the server what shared memory location we are for
-    WriteToSocket(const_cast<char*>(usageId.c_str()), usageId.length());
 }
 
 //---------------------------------------------------------------------
+// Paths that start with @ are in the Linux abstract namespace, they do
+// not exist in the file system and go away with the listening socket.
 //---------------------------------------------------------------------
-bool SocketSidebandData::WriteToSocket(const void* buffer, int64_t numBytes)
+static socklen_t UnixSocketAddress(const std::string& path, sockaddr_un* socketAddress)
 {
-    auto remainingBytes = numBytes;
-    const char* start = (const char*)buffer;
-    while (remainingBytes > 0)
+    memset(socketAddress, 0, sizeof(sockaddr_un));
+    socketAddress->sun_family = AF_UNIX;
+    auto name = path.substr(0, sizeof(socketAddress->sun_path) - 1);
+    memcpy(socketAddress->sun_path, name.c_str(), name.length());
+#ifdef __linux__
+    if (name[0] == '@')
     {
-        int written = send(_socket, start, remainingBytes, 0);
-        if (written < 0)
-        {
-            std::cout << "Error writing to buffer";
-            return false;
-        }
-        start += written;
-        remainingBytes -= written;
+        socketAddress->sun_path[0] = '\0';
+        return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + name.length());
     }
-    assert(remainingBytes == 0);
-    return true;
+#endif
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + name.length() + 1);
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-bool SocketSidebandData::ReadFromSocket(void* buffer, int64_t numBytes)
+static bool SocketWouldBlock()
 {
-    auto remainingBytes = numBytes;
-    char* start = (char*)buffer;
-    while (remainingBytes > 0)
-    {        
-        int n;
-        bool recvAgain = true;
-        do
-        {
 #ifdef _WIN32
-            n = recv(_socket, start, remainingBytes, 0);
-            auto wsaError = WSAGetLastError();
-            recvAgain = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || wsaError == WSAEWOULDBLOCK);
+    return WSAGetLastError() == WSAEWOULDBLOCK;
 #else
-            n = recv(_socket, start, remainingBytes, 0); // MSG_NOWAIT
-            recvAgain = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    return errno == EAGAIN || errno == EWOULDBLOCK;
 #endif
-        } while (recvAgain);
+}
 
-        if (n < 0)
+//---------------------------------------------------------------------
+// Windows has no per call non blocking flag so the socket itself is put
+// in non blocking mode for the policies that spin.  Low latency sockets
+// on Linux spin on MSG_DONTWAIT receives before blocking, except on a
+// single core where spinning only keeps the peer from running.
+//---------------------------------------------------------------------
+::SidebandWaitPolicy SocketSidebandData::SocketWaitPolicy()
+{
+    if (_waitPolicy == ::SidebandWaitPolicy::DEFAULT)
+    {
+#ifdef _WIN32
+        return _lowLatency ? ::SidebandWaitPolicy::SPIN : ::SidebandWaitPolicy::BLOCK;
+#else
+        static const bool multipleCores = std::thread::hardware_concurrency() > 1;
+        if (_lowLatency && multipleCores)
         {
-            std::cout << "Failed To read." << std::endl;
-            return false;
+            return ::SidebandWaitPolicy::SPIN_THEN_BLOCK;
         }
-        start += n;
-        remainingBytes -= n;
+        return ::SidebandWaitPolicy::BLOCK;
+#endif
     }
-    assert(remainingBytes == 0);
-    return true;
+    return _waitPolicy;
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-const std::string& SocketSidebandData::UsageId()
+void SocketSidebandData::ApplyWaitPolicy()
 {
-    return _id;
+#ifdef _WIN32
+    u_long iMode = SocketWaitPolicy() == ::SidebandWaitPolicy::BLOCK ? 0 : 1;
+    ioctlsocket(_socket, FIONBIO, &iMode);
+#endif
 }
 
 //---------------------------------------------------------------------
+// SOCK_SEQPACKET sockets keep the boundaries of each send, reads have
+// to be at least as large as the record they receive.
 //---------------------------------------------------------------------
-std::vector<std::string> SplitUrlString(const std::string& s)
+void SocketSidebandData::InitSocketType()
 {
-    char delimiter = ':';
-    std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream tokenStream(s);
-    while (std::getline(tokenStream, token, delimiter))
+    int type = 0;
+    socklen_t length = sizeof(type);
+    _messageBoundaries = false;
+    if (getsockopt(_socket, SOL_SOCKET, SO_TYPE, (char*)&type, &length) == 0)
     {
-        tokens.push_back(token);
+        _messageBoundaries = type == SOCK_SEQPACKET;
     }
-    return tokens;
+#ifdef __linux__
+    sockaddr_storage address;
+    length = sizeof(address);
+    _hypervisorSocket = getsockname(_socket, reinterpret_cast<sockaddr*>(&address), &length) == 0 && address.ss_family == AF_VSOCK;
+#endif
 }
 
 //---------------------------------------------------------------------
+// Low latency TCP sockets send right away instead of batching small
+// writes.  On Linux the socket also busy polls the device queue for
+// SOCKET_BUSY_POLL_MICROSECONDS when a receive finds no data.  Raising
+// the busy poll time above net.core.busy_read needs CAP_NET_ADMIN, the
+// socket keeps the system setting if it is refused.  Quick acks are
+// opt in, request / response traffic already carries the ack on the
+// response and a separate ack for every read only adds packets.
 //---------------------------------------------------------------------
-void SocketSidebandData::ReadConnectionId()
-{    
-    std::vector<char> buffer(ConnectIdLength());
-    ReadFromSocket(buffer.data(), ConnectIdLength());
-    _id = std::string(buffer.data(), ConnectIdLength());
+void SocketSidebandData::ApplyLowLatencyOptions()
+{
+    if (!_lowLatency)
+    {
+        return;
+    }
+    int yes = 1;
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(int));
+#ifdef __linux__
+    int busyPoll = static_cast<int>(GetSidebandDefaultProperty(::SidebandProperty::SOCKET_BUSY_POLL_MICROSECONDS, DefaultBusyPollMicroseconds));
+    if (busyPoll > 0)
+    {
+        setsockopt(_socket, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll));
+        setsockopt(_socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes, sizeof(yes));
+    }
+    if (GetSidebandDefaultProperty(::SidebandProperty::SOCKET_QUICK_ACK, 0) != 0)
+    {
+        _quickAck = setsockopt(_socket, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes)) == 0;
+    }
+#endif
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-void SocketSidebandData::QueueSidebandConnection(::SidebandStrategy strategy, const std::string& id, int64_t bufferSize)
+bool SocketSidebandData::SetSocketOption(int level, int option, int64_t value)
 {
-    _connectQueue.wait();
-#ifdef _WIN32
-    _nextConnectLowLatency = false;
-#else
-    _nextConnectLowLatency = strategy == ::SidebandStrategy::SOCKETS_LOW_LATENCY;
-#endif
-    _nextConnectBufferSize = bufferSize;
-    _nextConnectionId = id;
+    int optionValue = static_cast<int>(value);
+    return setsockopt(_socket, level, option, (char*)&optionValue, sizeof(optionValue)) == 0;
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-SocketSidebandData* SocketSidebandData::InitFromConnection(int socket)
+bool SocketSidebandData::GetSocketOption(int level, int option, int64_t* value)
 {
-    if (_nextConnectLowLatency)
+    int optionValue = 0;
+    socklen_t length = sizeof(optionValue);
+    if (_socket == INVALID_SOCKET || getsockopt(_socket, level, option, (char*)&optionValue, &length) != 0)
     {
-#ifdef _WIN32
-        u_long iMode = 1;
-        ioctlsocket(socket, FIONBIO, &iMode);
-#endif
-        int yes = 1;
-        int result = setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(int));
+        return false;
     }
-    auto sidebandData = new SocketSidebandData(socket, _nextConnectBufferSize, _nextConnectLowLatency);
-    sidebandData->ReadConnectionId();
-    RegisterSidebandData(sidebandData);
-    _connectQueue.notify();
-    return sidebandData;
+    *value = optionValue;
+    return true;
 }
 
 //---------------------------------------------------------------------
+// Smoothed round trip time the kernel has measured for a TCP socket,
+// 0 if it is not known.
 //---------------------------------------------------------------------
-SocketSidebandData* SocketSidebandData::ClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize, bool lowLatency)
-{    
-    auto tokens = SplitUrlString(sidebandServiceUrl);
-    auto sidebandData = new SocketSidebandData(usageId, bufferSize, lowLatency);
-    sidebandData->ConnectToSocket(tokens[0], tokens[1], usageId, lowLatency);
-    return sidebandData;
+int64_t SocketSidebandData::RoundTripMicroseconds()
+{
+#ifdef __linux__
+    tcp_info info;
+    socklen_t length = sizeof(info);
+    if (_socket != INVALID_SOCKET && getsockopt(_socket, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+    {
+        return info.tcpi_rtt;
+    }
+#endif
+    return 0;
 }
 
 //---------------------------------------------------------------------
+// Kernel send and receive buffers of a TCP socket.  autotuneLimit is the
+// sysctl holding the size the kernel grows the buffer to on its own,
+// setLimit the one holding the largest size the plain option accepts.
 //---------------------------------------------------------------------
-bool SocketSidebandData::Write(const uint8_t* bytes, int64_t byteCount)
+struct SocketBufferOption
 {
-    return WriteToSocket(bytes, byteCount);    
-}
+    ::SidebandProperty property;
+    int option;
+    int forceOption;
+    const char* autotuneLimit;
+    const char* setLimit;
+};
+
+static const SocketBufferOption s_SocketBufferOptions[] = {
+#ifdef __linux__
+    { ::SidebandProperty::SOCKET_SEND_BUFFER_SIZE, SO_SNDBUF, SO_SNDBUFFORCE, "/proc/sys/net/ipv4/tcp_wmem", "/proc/sys/net/core/wmem_max" },
+    { ::SidebandProperty::SOCKET_RECEIVE_BUFFER_SIZE, SO_RCVBUF, SO_RCVBUFFORCE, "/proc/sys/net/ipv4/tcp_rmem", "/proc/sys/net/core/rmem_max" }
+#else
+    { ::SidebandProperty::SOCKET_SEND_BUFFER_SIZE, SO_SNDBUF, SO_SNDBUF, nullptr, nullptr },
+    { ::SidebandProperty::SOCKET_RECEIVE_BUFFER_SIZE, SO_RCVBUF, SO_RCVBUF, nullptr, nullptr }
+#endif
+};
 
 //---------------------------------------------------------------------
+// Last number in a sysctl file, 0 if it cannot be read.
 //---------------------------------------------------------------------
-bool SocketSidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+static int64_t ReadSysctlLimit(const char* path)
 {
-    if (ReadFromSocket(bytes, bufferSize))
+    int64_t limit = 0;
+    if (path != nullptr)
     {
-        *numBytesRead = bufferSize;
-        return true;
+        std::ifstream file(path);
+        int64_t value = 0;
+        while (file >> value)
+        {
+            limit = value;
+        }
     }
-    return false;
+    return limit;
 }
 
 //---------------------------------------------------------------------
+// Sets a kernel buffer size, the force option lets CAP_NET_ADMIN go
+// past the system maximum.  Setting the size locks the buffer, the
+// kernel no longer tunes it.
 //---------------------------------------------------------------------
-bool SocketSidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
+static bool SetSocketBufferSize(SOCKET socket, const SocketBufferOption& buffer, int64_t size)
 {
-    auto result = WriteToSocket(&byteCount, sizeof(int64_t));    
-    if (result)
+    int value = static_cast<int>(size);
+    if (setsockopt(socket, SOL_SOCKET, buffer.forceOption, (char*)&value, sizeof(value)) == 0)
     {
-        result = WriteToSocket(bytes, byteCount);    
+        return true;
     }
-    return result;
+    return setsockopt(socket, SOL_SOCKET, buffer.option, (char*)&value, sizeof(value)) == 0;
 }
 
 //---------------------------------------------------------------------
+// The TCP window scale is fixed by the SYN, so buffer sizes set by
+// property go on listeners before listen and on clients before connect.
+// Accepted sockets inherit them from the listener.
 //---------------------------------------------------------------------
-bool SocketSidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+static void ApplyConfiguredSocketBufferSizes(SOCKET socket)
 {
-    return Read(bytes, bufferSize, numBytesRead);    
+    for (auto& buffer : s_SocketBufferOptions)
+    {
+        auto size = GetSidebandDefaultProperty(buffer.property, 0);
+        if (size > 0)
+        {
+            SetSocketBufferSize(socket, buffer, size);
+        }
+    }
 }
 
 //---------------------------------------------------------------------
+// Kernel buffers have to hold at least two frames so the writer can
+// queue the next one while the previous one is still being received,
+// and the bandwidth-delay product of the link so a single connection
+// can fill it.  Automatic sizes are left to the kernel's own tuning
+// when it grows the buffer that far, and only ever raise the buffers
+// otherwise.  Without CAP_NET_ADMIN a size above net.core.wmem_max /
+// rmem_max is not set at all, the kernel would clamp it and lock the
+// buffer smaller than its tuning gets.
 //---------------------------------------------------------------------
-int64_t SocketSidebandData::ReadLengthPrefix()
+void SocketSidebandData::ApplySocketBufferSizes()
 {
-    int64_t bufferSize = 0;
-    ReadFromSocket(&bufferSize, sizeof(int64_t));
-    return bufferSize;
+    auto linkBytesPerSecond = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_LINK_BYTES_PER_SECOND, DefaultLinkBytesPerSecond);
+    auto bandwidthDelay = RoundTripMicroseconds() * (linkBytesPerSecond / 1000000);
+    auto automatic = 2 * (_bufferSize + static_cast<int64_t>(sizeof(int64_t)));
+    automatic = bandwidthDelay > automatic ? bandwidthDelay : automatic;
+    automatic = automatic < MaxAutoSocketBufferSize ? automatic : MaxAutoSocketBufferSize;
+
+#ifdef __linux__
+    if (_hypervisorSocket)
+    {
+        // The receive buffer of a hypervisor socket is the credit its peer
+        // may send without waiting, the default 256KB keeps a single
+        // connection well below the transport's bandwidth.
+        auto size = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_RECEIVE_BUFFER_SIZE, 0);
+        if (size == 0)
+        {
+            size = automatic > MinimumHypervisorSocketBufferSize ? automatic : MinimumHypervisorSocketBufferSize;
+        }
+        uint64_t bufferSize = static_cast<uint64_t>(size);
+        if (setsockopt(_socket, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE, &bufferSize, sizeof(bufferSize)) != 0 ||
+            setsockopt(_socket, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE, &bufferSize, sizeof(bufferSize)) != 0)
+        {
+            std::cout << "Unable to set the hypervisor socket buffer size to " << size << " error: " << GetSocketError() << std::endl;
+        }
+        return;
+    }
+#endif
+
+    for (auto& buffer : s_SocketBufferOptions)
+    {
+        auto size = GetSidebandDefaultProperty(buffer.property, 0);
+        if (size > 0)
+        {
+            // Normally set before connect or inherited from the listener
+            // already, unix sockets and late changes get it here.
+            SetSocketBufferSize(_socket, buffer, size);
+            continue;
+        }
+        int64_t current = 0;
+        if (GetSocketOption(SOL_SOCKET, buffer.option, &current) && current >= automatic)
+        {
+            continue;
+        }
+        if (buffer.autotuneLimit != nullptr && ReadSysctlLimit(buffer.autotuneLimit) >= automatic)
+        {
+            continue;
+        }
+        if (SetSocketOption(SOL_SOCKET, buffer.forceOption, automatic))
+        {
+            continue;
+        }
+        if (buffer.setLimit == nullptr || automatic <= ReadSysctlLimit(buffer.setLimit))
+        {
+            SetSocketOption(SOL_SOCKET, buffer.option, automatic);
+        }
+    }
+
+#ifdef TCP_NOTSENT_LOWAT
+    auto notSentLowWater = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_NOTSENT_LOWAT, 0);
+    if (notSentLowWater > 0)
+    {
+        SetSocketOption(IPPROTO_TCP, TCP_NOTSENT_LOWAT, notSentLowWater);
+    }
+#endif
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-std::string GetSocketsAddress()
+bool SocketSidebandData::SetProperty(::SidebandProperty property, int64_t value)
 {
-    if (s_SidebandSocketsAddress.length() > 0)
+    if (property == ::SidebandProperty::SOCKET_ZEROCOPY_THRESHOLD)
     {
-        return s_SidebandSocketsAddress;
+        if (value < 0)
+        {
+            return false;
+        }
+        _zeroCopyThreshold = value;
+        return value == 0 || _socket == INVALID_SOCKET || EnableZeroCopy();
     }
-#ifdef ENABLE_RDMA_SIDEBAND
-    auto rdmaAddress = GetRdmaAddress();
-    if (rdmaAddress.length() > 0)
+    if (property == ::SidebandProperty::SOCKET_IO_URING)
     {
-        return rdmaAddress;
+        if (value < 0 || value > 2)
+        {
+            return false;
+        }
+        _ioUringMode = value;
+        _ioUring.reset();
+        if (value == 0)
+        {
+            return true;
+        }
+        return _socket == INVALID_SOCKET || EnableIoUring();
+    }
+    if (property == ::SidebandProperty::SOCKET_READ_AHEAD_BYTES)
+    {
+        if (value < 0)
+        {
+            return false;
+        }
+        _readAheadSize = value;
+        return true;
+    }
+    if (property == ::SidebandProperty::SOCKET_COMPRESSION)
+    {
+        return Compression()->SetMode(value);
+    }
+    if (property == ::SidebandProperty::SOCKET_COMPRESSION_ELEMENT_SIZE)
+    {
+        return Compression()->SetElementSize(value);
+    }
+    if (property == ::SidebandProperty::SOCKET_SEND_BUFFER_SIZE || property == ::SidebandProperty::SOCKET_RECEIVE_BUFFER_SIZE)
+    {
+        auto option = property == ::SidebandProperty::SOCKET_SEND_BUFFER_SIZE ? SO_SNDBUF : SO_RCVBUF;
+        return value > 0 && _socket != INVALID_SOCKET && SetSocketOption(SOL_SOCKET, option, value);
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (property == ::SidebandProperty::SOCKET_NOTSENT_LOWAT)
+    {
+        return value > 0 && _socket != INVALID_SOCKET && SetSocketOption(IPPROTO_TCP, TCP_NOTSENT_LOWAT, value);
     }
 #endif
-    return "localhost";
+    if (!SidebandData::SetProperty(property, value))
+    {
+        return false;
+    }
+    if (property == ::SidebandProperty::WAIT_POLICY && _socket != INVALID_SOCKET)
+    {
+        ApplyWaitPolicy();
+    }
+    return true;
 }
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
-std::string GetSocketsPort()
+bool SocketSidebandData::GetProperty(::SidebandProperty property, int64_t* value)
 {
-    if (s_SidebandSocketsPort > 0)
+    switch (property)
     {
-        return std::to_string(s_SidebandSocketsPort);
+        case ::SidebandProperty::SOCKET_SEND_CALLS:
+            *value = _sendCalls;
+            return true;
+        case ::SidebandProperty::SOCKET_RECEIVE_CALLS:
+            *value = _receiveCalls;
+            return true;
+        case ::SidebandProperty::SOCKET_ZEROCOPY_THRESHOLD:
+            *value = _zeroCopyThreshold;
+            return true;
+        case ::SidebandProperty::SOCKET_ZEROCOPY_SENDS:
+            *value = _zeroCopySends;
+            return true;
+        case ::SidebandProperty::SOCKET_ZEROCOPY_COPIED:
+            *value = _zeroCopyCopied;
+            return true;
+        case ::SidebandProperty::SOCKET_IO_URING:
+            *value = !_ioUring ? 0 : _ioUring->UsesSqPoll() ? 2 : 1;
+            return true;
+        case ::SidebandProperty::SOCKET_QUICK_ACK:
+            *value = _quickAck ? 1 : 0;
+            return true;
+        case ::SidebandProperty::SOCKET_SEND_BUFFER_SIZE:
+            return GetSocketOption(SOL_SOCKET, SO_SNDBUF, value);
+        case ::SidebandProperty::SOCKET_RECEIVE_BUFFER_SIZE:
+#ifdef __linux__
+            if (_hypervisorSocket)
+            {
+                uint64_t bufferSize = 0;
+                socklen_t length = sizeof(bufferSize);
+                if (getsockopt(_socket, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE, &bufferSize, &length) != 0)
+                {
+                    return false;
+                }
+                *value = static_cast<int64_t>(bufferSize);
+                return true;
+            }
+#endif
+            return GetSocketOption(SOL_SOCKET, SO_RCVBUF, value);
+#ifdef TCP_NOTSENT_LOWAT
+        case ::SidebandProperty::SOCKET_NOTSENT_LOWAT:
+            return GetSocketOption(IPPROTO_TCP, TCP_NOTSENT_LOWAT, value);
+#endif
+        case ::SidebandProperty::SOCKET_ROUND_TRIP_MICROSECONDS:
+            *value = RoundTripMicroseconds();
+            return true;
+        case ::SidebandProperty::SOCKET_STRIPES:
+            *value = _stripeCount > 1 ? _stripeCount : 1;
+            return true;
+        case ::SidebandProperty::SOCKET_READ_AHEAD_BYTES:
+            *value = _messageBoundaries ? 0 : _readAheadSize;
+            return true;
+        case ::SidebandProperty::SOCKET_COMPRESSION:
+            *value = _compression ? _compression->ActiveMode() : CompressionOff;
+            return true;
+        case ::SidebandProperty::SOCKET_COMPRESSION_ELEMENT_SIZE:
+            *value = Compression()->ElementSize();
+            return true;
+        case ::SidebandProperty::SOCKET_COMPRESSION_RATIO_PERCENT:
+        {
+            auto rawBytes = (_compression ? _compression->RawBytes() : 0) + (_decompression ? _decompression->RawBytes() : 0);
+            auto wireBytes = (_compression ? _compression->WireBytes() : 0) + (_decompression ? _decompression->WireBytes() : 0);
+            *value = rawBytes == 0 ? 100 : (wireBytes * 100 + rawBytes / 2) / rawBytes;
+            return true;
+        }
+        case ::SidebandProperty::SOCKET_COMPRESSION_MICROSECONDS:
+            *value = (_compression ? _compression->Microseconds() : 0) + (_decompression ? _decompression->Microseconds() : 0);
+            return true;
+#ifdef __linux__
+        case ::SidebandProperty::SOCKET_BUSY_POLL_MICROSECONDS:
+        {
+            int busyPoll = 0;
+            socklen_t length = sizeof(busyPoll);
+            if (_socket == INVALID_SOCKET || getsockopt(_socket, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, &length) != 0)
+            {
+                return false;
+            }
+            *value = busyPoll;
+            return true;
+        }
+#endif
     }
-    return "50055";
+    return SidebandData::GetProperty(property, value);
 }
 
 //---------------------------------------------------------------------
+// The socket is already a pollable file descriptor, it becomes readable
+// when a message arrives.  Messages held in the read-ahead buffer would
+// not wake it so read-ahead is turned off.  Bytes read ahead before
+// that, and the rest of a compressed frame the caller has only read
+// part of, are still served from memory and never wake the socket, the
+// caller reads them before it polls.
 //---------------------------------------------------------------------
-int32_t _SIDEBAND_FUNC RunSidebandSocketsAccept(const char* address, int port, std::atomic<bool>& stop_flag)
+int SocketSidebandData::GetDoorbell()
 {
-    int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr;
-
-#ifdef _WIN32
-    WSADATA wsaData {};
-    WSAStartup(MAKEWORD(2,2), &wsaData);
+    if (_socket == INVALID_SOCKET)
+    {
+        return -1;
+    }
+    _readAheadSize = 0;
+    if (_recordOffset < _recordLength || _decompressed != nullptr)
+    {
+        std::cout << "Sideband " << UsageId() << " already holds data that will not wake its doorbell, read it before polling." << std::endl;
+    }
+    return static_cast<int>(_socket);
+}
+
+//---------------------------------------------------------------------
+// Zero copy sends pin the pages of the send buffer instead of copying
+// them into the kernel.  The buffer must not change until the kernel
+// reports on the error queue that it has released it.
+//---------------------------------------------------------------------
+bool SocketSidebandData::EnableZeroCopy()
+{
+#ifdef __linux__
+    if (_zeroCopyEnabled)
+    {
+        return true;
+    }
+    int yes = 1;
+    if (_messageBoundaries || setsockopt(_socket, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) != 0)
+    {
+        std::cout << "Zero copy sends are not supported on this socket, sending with copies." << std::endl;
+        return false;
+    }
+    _zeroCopyEnabled = true;
+    return true;
+#else
+    std::cout << "Zero copy sends are only supported on Linux." << std::endl;
+    return false;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Each zero copy send gets the next number starting at 0, the kernel
+// reports finished sends as ranges of those numbers.
+//---------------------------------------------------------------------
+bool SocketSidebandData::ReadZeroCopyCompletions()
+{
+#ifdef __linux__
+    while (true)
+    {
+        char control[128];
+        msghdr message {};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(_socket, &message, MSG_ERRQUEUE) < 0)
+        {
+            return SocketWouldBlock();
+        }
+        for (auto header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+        {
+            if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) &&
+                !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            auto error = reinterpret_cast<sock_extended_err*>(CMSG_DATA(header));
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+            uint32_t count = error->ee_data - error->ee_info + 1;
+            _zeroCopyCompleted += count;
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                // The device could not send from user pages, loopback never can
+                _zeroCopyCopied += count;
+            }
+        }
+    }
+#else
+    return true;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Waits until the kernel has released the buffers of the first
+// sendCount zero copy sends.
+//---------------------------------------------------------------------
+bool SocketSidebandData::WaitForZeroCopy(int64_t sendCount)
+{
+#ifdef __linux__
+    while (_zeroCopyCompleted < sendCount)
+    {
+        if (!ReadZeroCopyCompletions())
+        {
+            std::cout << "Failed to read zero copy completions." << std::endl;
+            return false;
+        }
+        if (_zeroCopyCompleted >= sendCount)
+        {
+            break;
+        }
+        pollfd pollSocket { static_cast<int>(_socket), 0, 0 };
+        poll(&pollSocket, 1, 100);
+        if (pollSocket.revents & (POLLHUP | POLLNVAL))
+        {
+            std::cout << "Socket closed with zero copy sends outstanding." << std::endl;
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Moves sends and receives to an io_uring.  The serialize buffer and the
+// direct read and write buffers are registered with the ring so
+// transfers with them skip mapping the pages on every call.  Mode 2 adds a kernel
+// polling thread so sends need no system call, it keeps a core busy.
+//---------------------------------------------------------------------
+bool SocketSidebandData::EnableIoUring()
+{
+    if (_ioUring)
+    {
+        return true;
+    }
+    std::unique_ptr<SocketIoUring> ioUring(new SocketIoUring(static_cast<int>(_socket)));
+    if (!ioUring->Init(_ioUringMode == 2))
+    {
+        std::cout << "io_uring is not available for this socket, using socket calls." << std::endl;
+        return false;
+    }
+    std::vector<SocketBuffer> buffers;
+    auto serializeBuffer = SerializeBuffer();
+    if (serializeBuffer != nullptr)
+    {
+        buffers.push_back({ reinterpret_cast<char*>(serializeBuffer), _bufferSize });
+    }
+    for (auto& sendBuffer : _sendBuffers)
+    {
+        if (sendBuffer == nullptr)
+        {
+            sendBuffer = AllocateNumaBuffer(_bufferSize + sizeof(int64_t), _numaPolicy, _numaNode);
+        }
+        if (sendBuffer != nullptr)
+        {
+            buffers.push_back({ reinterpret_cast<char*>(sendBuffer), _bufferSize + static_cast<int64_t>(sizeof(int64_t)) });
+        }
+    }
+    if (ReceiveBuffer(_bufferSize) != nullptr)
+    {
+        buffers.push_back({ reinterpret_cast<char*>(_receiveBuffer), _receiveBufferSize });
+    }
+    if (!ioUring->RegisterBuffers(buffers))
+    {
+        std::cout << "Failed to register io_uring buffers, transfers map buffers on each call." << std::endl;
+    }
+    _ioUring = std::move(ioUring);
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Compresses the frames this side writes, created the first time
+// compression is turned on.
+//---------------------------------------------------------------------
+SidebandCompression* SocketSidebandData::Compression()
+{
+    if (!_compression)
+    {
+        _compression.reset(new SidebandCompression());
+        _compression->SetElementSize(GetSidebandDefaultProperty(::SidebandProperty::SOCKET_COMPRESSION_ELEMENT_SIZE, _compression->ElementSize()));
+        _compression->SetLinkBytesPerSecond(GetSidebandDefaultProperty(::SidebandProperty::SOCKET_LINK_BYTES_PER_SECOND, DefaultLinkBytesPerSecond));
+    }
+    return _compression.get();
+}
+
+//---------------------------------------------------------------------
+// Decompresses the frames this side reads, separate from Compression()
+// so a reading and a writing thread do not share buffers.  Created when
+// the first compressed frame arrives.
+//---------------------------------------------------------------------
+SidebandCompression* SocketSidebandData::Decompression()
+{
+    if (!_decompression)
+    {
+        _decompression.reset(new SidebandCompression());
+    }
+    return _decompression.get();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t DefaultConnectTimeoutMilliseconds = 5000;
+static const int64_t ConnectionAttemptDelayMilliseconds = 250;
+static const int64_t ResolvedAddressLifetimeSeconds = 60;
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+struct ResolvedSocketAddress
+{
+    sockaddr_storage address;
+    socklen_t addressLength;
+};
+
+//---------------------------------------------------------------------
+// Resolved addresses of a sideband server, the address that connected
+// last comes first.  Entries are resolved again after
+// ResolvedAddressLifetimeSeconds so address changes are picked up.
+//---------------------------------------------------------------------
+struct ResolvedSocketServer
+{
+    std::vector<ResolvedSocketAddress> candidates;
+    std::chrono::steady_clock::time_point resolvedAt;
+};
+
+//---------------------------------------------------------------------
+// Resolved sideband servers by "address:port".
+//---------------------------------------------------------------------
+static std::mutex s_ResolvedAddressesMutex;
+static std::map<std::string, ResolvedSocketServer> s_ResolvedAddresses;
+
+//---------------------------------------------------------------------
+// getaddrinfo sorts the addresses by preference, the candidates keep
+// that order but alternate between the address families so a family
+// that does not work only costs one connection attempt delay.
+//---------------------------------------------------------------------
+static std::vector<ResolvedSocketAddress> ResolveSocketAddress(const std::string& address, const std::string& port)
+{
+    std::vector<ResolvedSocketAddress> candidates;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo* resultAddress = nullptr;
+    auto result = getaddrinfo(address.c_str(), port.c_str(), &hints, &resultAddress);
+    if (result != 0)
+    {
+        std::cout << "getaddrinfo failed with error: " << result << std::endl;
+        return candidates;
+    }
+    std::vector<ResolvedSocketAddress> families[2];
+    for (addrinfo* current = resultAddress; current != nullptr; current = current->ai_next)
+    {
+        if (current->ai_addrlen > sizeof(sockaddr_storage))
+        {
+            continue;
+        }
+        ResolvedSocketAddress resolved;
+        memset(&resolved, 0, sizeof(resolved));
+        memcpy(&resolved.address, current->ai_addr, current->ai_addrlen);
+        resolved.addressLength = static_cast<socklen_t>(current->ai_addrlen);
+        families[current->ai_family == resultAddress->ai_family ? 0 : 1].push_back(resolved);
+    }
+    freeaddrinfo(resultAddress);
+    for (size_t x = 0; x < families[0].size() || x < families[1].size(); ++x)
+    {
+        for (auto& family : families)
+        {
+            if (x < family.size())
+            {
+                candidates.push_back(family[x]);
+            }
+        }
+    }
+    return candidates;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static void SetSocketBlocking(SOCKET socket, bool blocking)
+{
+#ifdef _WIN32
+    u_long iMode = blocking ? 0 : 1;
+    ioctlsocket(socket, FIONBIO, &iMode);
+#else
+    auto flags = fcntl(socket, F_GETFL);
+    fcntl(socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static bool ConnectInProgress()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+//---------------------------------------------------------------------
+// Happy Eyeballs (RFC 8305): a nonblocking connect to the first
+// candidate, then one to the next candidate whenever an attempt fails
+// or the previous one has not completed within the attempt delay.  The
+// first connection to complete wins and the others are closed.  Returns
+// false when nothing connected before the deadline.
+//---------------------------------------------------------------------
+static bool ConnectToFirstAddress(const std::vector<ResolvedSocketAddress>& candidates, std::chrono::steady_clock::time_point deadline, SOCKET* connectedSocket, size_t* connectedIndex)
+{
+    std::vector<pollfd> attempts;
+    std::vector<size_t> attemptIndexes;
+    size_t nextCandidate = 0;
+    auto nextAttempt = std::chrono::steady_clock::now();
+    bool connected = false;
+    while (!connected)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+        {
+            break;
+        }
+        if (nextCandidate < candidates.size() && (attempts.empty() || now >= nextAttempt))
+        {
+            auto& candidate = candidates[nextCandidate];
+            auto attempt = socket(candidate.address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+            if (!IsValidSocket(attempt))
+            {
+                std::cout << "socket failed with error: " << GetSocketError() << std::endl;
+                ++nextCandidate;
+                continue;
+            }
+            ApplyConfiguredSocketBufferSizes(attempt);
+            SetSocketBlocking(attempt, false);
+            if (connect(attempt, (const sockaddr*)&candidate.address, candidate.addressLength) == 0)
+            {
+                *connectedSocket = attempt;
+                *connectedIndex = nextCandidate;
+                connected = true;
+                break;
+            }
+            if (!ConnectInProgress())
+            {
+                CloseSocket(attempt);
+                ++nextCandidate;
+                continue;
+            }
+            pollfd attemptFd;
+            attemptFd.fd = attempt;
+            attemptFd.events = POLLOUT;
+            attemptFd.revents = 0;
+            attempts.push_back(attemptFd);
+            attemptIndexes.push_back(nextCandidate);
+            ++nextCandidate;
+            nextAttempt = now + std::chrono::milliseconds(ConnectionAttemptDelayMilliseconds);
+        }
+        if (attempts.empty())
+        {
+            break;
+        }
+        auto waitUntil = nextCandidate < candidates.size() && nextAttempt < deadline ? nextAttempt : deadline;
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(waitUntil - now).count() + 1;
+#ifdef _WIN32
+        auto ready = WSAPoll(attempts.data(), static_cast<ULONG>(attempts.size()), static_cast<INT>(timeout));
+#else
+        auto ready = poll(attempts.data(), attempts.size(), static_cast<int>(timeout));
+#endif
+        if (ready <= 0)
+        {
+            continue;
+        }
+        for (size_t x = 0; x < attempts.size();)
+        {
+            if (attempts[x].revents == 0)
+            {
+                ++x;
+                continue;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(attempts[x].fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == 0 && error == 0 && (attempts[x].revents & POLLOUT) != 0)
+            {
+                *connectedSocket = attempts[x].fd;
+                *connectedIndex = attemptIndexes[x];
+                attempts.erase(attempts.begin() + x);
+                attemptIndexes.erase(attemptIndexes.begin() + x);
+                connected = true;
+                break;
+            }
+            // Failed, start the next candidate without waiting for the delay
+            CloseSocket(attempts[x].fd);
+            attempts.erase(attempts.begin() + x);
+            attemptIndexes.erase(attemptIndexes.begin() + x);
+            nextAttempt = std::chrono::steady_clock::now();
+        }
+    }
+    for (auto& attempt : attempts)
+    {
+        CloseSocket(attempt.fd);
+    }
+    if (connected)
+    {
+        SetSocketBlocking(*connectedSocket, true);
+    }
+    return connected;
+}
+
+//---------------------------------------------------------------------
+// The server's addresses are resolved once and cached for
+// ResolvedAddressLifetimeSeconds.  Cached addresses get half of the
+// SOCKET_CONNECT_TIMEOUT_MILLISECONDS deadline, when they do not connect
+// in that time the server is resolved again and the fresh addresses get
+// the rest, so a stale entry cannot use up the whole timeout.
+//---------------------------------------------------------------------
+void SocketSidebandData::ConnectToSocket(std::string address, std::string port, std::string usageId, bool lowLatency)
+{
+    auto timeout = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_CONNECT_TIMEOUT_MILLISECONDS, DefaultConnectTimeoutMilliseconds);
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(timeout);
+    auto key = address + ":" + port;
+    std::vector<ResolvedSocketAddress> candidates;
+    std::chrono::steady_clock::time_point resolvedAt;
+    {
+        std::lock_guard<std::mutex> lock(s_ResolvedAddressesMutex);
+        auto resolved = s_ResolvedAddresses.find(key);
+        if (resolved != s_ResolvedAddresses.end())
+        {
+            if (start - resolved->second.resolvedAt < std::chrono::seconds(ResolvedAddressLifetimeSeconds))
+            {
+                candidates = resolved->second.candidates;
+                resolvedAt = resolved->second.resolvedAt;
+            }
+            else
+            {
+                s_ResolvedAddresses.erase(resolved);
+            }
+        }
+    }
+    auto cached = !candidates.empty();
+    if (!cached)
+    {
+        candidates = ResolveSocketAddress(address, port);
+        resolvedAt = std::chrono::steady_clock::now();
+    }
+    SOCKET connectedSocket = INVALID_SOCKET;
+    size_t connectedIndex = 0;
+    auto cachedDeadline = cached ? start + std::chrono::milliseconds(timeout / 2) : deadline;
+    auto connected = ConnectToFirstAddress(candidates, cachedDeadline, &connectedSocket, &connectedIndex);
+    if (!connected && cached)
+    {
+        candidates = ResolveSocketAddress(address, port);
+        resolvedAt = std::chrono::steady_clock::now();
+        connected = ConnectToFirstAddress(candidates, deadline, &connectedSocket, &connectedIndex);
+    }
+    {
+        std::lock_guard<std::mutex> lock(s_ResolvedAddressesMutex);
+        if (connected)
+        {
+            std::rotate(candidates.begin(), candidates.begin() + connectedIndex, candidates.begin() + connectedIndex + 1);
+            auto& server = s_ResolvedAddresses[key];
+            server.candidates = candidates;
+            server.resolvedAt = resolvedAt;
+        }
+        else
+        {
+            s_ResolvedAddresses.erase(key);
+        }
+    }
+    if (!connected)
+    {
+        std::cout << "Unable to connect to server!" << std::endl;
+        return;
+    }
+    _socket = connectedSocket;
+
+    ApplyLowLatencyOptions();
+    ApplySocketBufferSizes();
+    ApplyWaitPolicy();
+    if (_zeroCopyThreshold > 0)
+    {
+        EnableZeroCopy();
+    }
+
+    // Tell the server what shared memory location we are for
+    WriteToSocket(const_cast<char*>(usageId.c_str()), usageId.length());
+    if (_ioUringMode != 0)
+    {
+        EnableIoUring();
+    }
+}
+
+//---------------------------------------------------------------------
+// Listeners use SOCK_SEQPACKET where the platform has it and a stream
+// socket otherwise, connecting with the wrong type fails with
+// EPROTOTYPE so the client tries the stream socket next.
+//---------------------------------------------------------------------
+void SocketSidebandData::ConnectToUnixSocket(const std::string& path, const std::string& usageId)
+{
+    sockaddr_un socketAddress;
+    auto addressLength = UnixSocketAddress(path, &socketAddress);
+#ifdef __linux__
+    int socketTypes[] = { SOCK_SEQPACKET, SOCK_STREAM };
+#else
+    int socketTypes[] = { SOCK_STREAM };
+#endif
+    for (auto socketType : socketTypes)
+    {
+        auto unixSocket = socket(AF_UNIX, socketType, 0);
+        if (!IsValidSocket(unixSocket))
+        {
+            continue;
+        }
+        if (connect(unixSocket, (struct sockaddr*)&socketAddress, addressLength) == 0)
+        {
+            _socket = unixSocket;
+            break;
+        }
+        auto error = GetSocketError();
+        CloseSocket(unixSocket);
+#ifndef _WIN32
+        if (error == EPROTOTYPE)
+        {
+            continue;
+        }
+#endif
+        std::cout << "Unable to connect to " << path << " error: " << error << std::endl;
+        return;
+    }
+    if (_socket == INVALID_SOCKET)
+    {
+        std::cout << "Unable to connect to server!" << std::endl;
+        return;
+    }
+    FinishClientConnect(usageId);
+}
+
+#ifdef __linux__
+//---------------------------------------------------------------------
+// Context ids and ports of hypervisor sockets are 32 bit numbers.
+//---------------------------------------------------------------------
+static bool ParseHypervisorSocketNumber(const std::string& text, unsigned int* number)
+{
+    try
+    {
+        size_t length = 0;
+        auto value = std::stoull(text, &length);
+        if (length != text.length() || value > 0xFFFFFFFFull)
+        {
+            return false;
+        }
+        *number = static_cast<unsigned int>(value);
+        return true;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+#endif
+
+//---------------------------------------------------------------------
+// Hypervisor sockets (AF_VSOCK) connect a virtual machine and its host
+// without going through a virtual network card.  The address is the
+// context id of the listener's side and the port it listens on.
+//---------------------------------------------------------------------
+void SocketSidebandData::ConnectToHypervisorSocket(const std::string& cid, const std::string& port, const std::string& usageId)
+{
+#ifdef __linux__
+    sockaddr_vm socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.svm_family = AF_VSOCK;
+    if (!ParseHypervisorSocketNumber(cid, &socketAddress.svm_cid) || !ParseHypervisorSocketNumber(port, &socketAddress.svm_port))
+    {
+        std::cout << "Invalid hypervisor socket address " << cid << ":" << port << std::endl;
+        return;
+    }
+    auto hypervisorSocket = socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (!IsValidSocket(hypervisorSocket))
+    {
+        std::cout << "Unable to open hypervisor socket error: " << GetSocketError() << std::endl;
+        return;
+    }
+    if (connect(hypervisorSocket, (struct sockaddr*)&socketAddress, sizeof(socketAddress)) != 0)
+    {
+        std::cout << "Unable to connect to " << cid << ":" << port << " error: " << GetSocketError() << std::endl;
+        CloseSocket(hypervisorSocket);
+        return;
+    }
+    _socket = hypervisorSocket;
+    FinishClientConnect(usageId);
+#else
+    std::cout << "Hypervisor sockets are only supported on Linux." << std::endl;
+#endif
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void SocketSidebandData::FinishClientConnect(const std::string& usageId)
+{
+    InitSocketType();
+    ApplySocketBufferSizes();
+    ApplyWaitPolicy();
+
+    // Tell the server what connection we are for
+    WriteToSocket(usageId.c_str(), usageId.length());
+    if (_ioUringMode != 0)
+    {
+        EnableIoUring();
+    }
+}
+
+//---------------------------------------------------------------------
+// One send call for all of the buffers.  Returns the number of bytes
+// sent from the start of the buffers.
+//---------------------------------------------------------------------
+int64_t SocketSidebandData::SendBuffers(SocketBuffer* buffers, int count, bool zeroCopy)
+{
+    if (_ioUring)
+    {
+        auto calls = _ioUring->SystemCalls();
+        auto written = _ioUring->Send(buffers, count, SocketWaitPolicy(), _spinMicroseconds);
+        _sendCalls += _ioUring->SystemCalls() - calls;
+        return written;
+    }
+    int64_t written = -1;
+#ifdef _WIN32
+    WSABUF sendBuffers[MaxSocketBuffers];
+    for (int x = 0; x < count; ++x)
+    {
+        sendBuffers[x].buf = buffers[x].data;
+        sendBuffers[x].len = static_cast<ULONG>(buffers[x].length);
+    }
+    DWORD sent = 0;
+    written = WSASend(_socket, sendBuffers, count, &sent, 0, nullptr, nullptr) == 0 ? sent : -1;
+#else
+    iovec sendBuffers[MaxSocketBuffers];
+    for (int x = 0; x < count; ++x)
+    {
+        sendBuffers[x].iov_base = buffers[x].data;
+        sendBuffers[x].iov_len = buffers[x].length;
+    }
+    msghdr message {};
+    message.msg_iov = sendBuffers;
+    message.msg_iovlen = count;
+    written = sendmsg(_socket, &message, zeroCopy ? MSG_ZEROCOPY : 0);
+#endif
+    if (written >= 0 || !SocketWouldBlock())
+    {
+        ++_sendCalls;
+    }
+    return written;
+}
+
+//---------------------------------------------------------------------
+// Sends all of the buffers with as few system calls as possible, a
+// length prefixed frame goes out in one sendmsg / WSASend.  After a
+// partial send the buffers are advanced past the bytes that went out.
+// Records on SOCK_SEQPACKET sockets are capped at UnixSocketMaxRecord.
+//---------------------------------------------------------------------
+bool SocketSidebandData::WriteBuffersToSocket(SocketBuffer* buffers, int count)
+{
+    int64_t totalBytes = 0;
+    for (int x = 0; x < count; ++x)
+    {
+        totalBytes += buffers[x].length;
+    }
+    auto zeroCopy = _zeroCopyEnabled && !_ioUring && _zeroCopyThreshold > 0 && totalBytes >= _zeroCopyThreshold;
+    int current = 0;
+    while (current < count)
+    {
+        if (buffers[current].length == 0)
+        {
+            ++current;
+            continue;
+        }
+        auto recordBytes = _messageBoundaries ? UnixSocketMaxRecord : INT32_MAX;
+        int sendCount = 0;
+        SocketBuffer sendBuffers[MaxSocketBuffers];
+        for (int x = current; x < count && sendCount < MaxSocketBuffers && recordBytes > 0; ++x)
+        {
+            auto length = buffers[x].length < recordBytes ? buffers[x].length : recordBytes;
+            sendBuffers[sendCount].data = buffers[x].data;
+            sendBuffers[sendCount].length = length;
+            recordBytes -= length;
+            ++sendCount;
+        }
+
+        auto written = SendBuffers(sendBuffers, sendCount, zeroCopy);
+#ifndef _WIN32
+        if (written < 0 && zeroCopy && errno == ENOBUFS)
+        {
+            // Too many zero copy sends in flight, wait for the oldest
+            if (!WaitForZeroCopy(_zeroCopyCompleted + 1))
+            {
+                return false;
+            }
+            continue;
+        }
+#endif
+        if (written < 0 && SocketWouldBlock())
+        {
+            SidebandCpuPause();
+            continue;
+        }
+        if (written > 0 && zeroCopy)
+        {
+            ++_zeroCopySends;
+        }
+        if (written < 0)
+        {
+            std::cout << "Error writing to buffer";
+            return false;
+        }
+        while (written > 0)
+        {
+            if (written >= buffers[current].length)
+            {
+                written -= buffers[current].length;
+                ++current;
+            }
+            else
+            {
+                buffers[current].data += written;
+                buffers[current].length -= written;
+                written = 0;
+            }
+        }
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::WriteToSocket(const void* buffer, int64_t numBytes)
+{
+    SocketBuffer socketBuffer { const_cast<char*>(static_cast<const char*>(buffer)), numBytes };
+    return WriteBuffersToSocket(&socketBuffer, 1) && WaitForZeroCopy(_zeroCopySends);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SocketSidebandData::ReceiveBuffers(SocketBuffer* buffers, int count, bool wait)
+{
+#ifdef _WIN32
+    if (wait)
+    {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(_socket, &read_fds);
+        select(0, &read_fds, nullptr, nullptr, nullptr);
+    }
+    WSABUF receiveBuffers[MaxSocketBuffers];
+    for (int x = 0; x < count; ++x)
+    {
+        receiveBuffers[x].buf = buffers[x].data;
+        receiveBuffers[x].len = static_cast<ULONG>(buffers[x].length);
+    }
+    DWORD received = 0;
+    DWORD flags = 0;
+    return WSARecv(_socket, receiveBuffers, count, &received, &flags, nullptr, nullptr) == 0 ? received : -1;
+#else
+    iovec receiveBuffers[MaxSocketBuffers];
+    for (int x = 0; x < count; ++x)
+    {
+        receiveBuffers[x].iov_base = buffers[x].data;
+        receiveBuffers[x].iov_len = buffers[x].length;
+    }
+    msghdr message {};
+    message.msg_iov = receiveBuffers;
+    message.msg_iovlen = count;
+    int flags = wait ? 0 : MSG_DONTWAIT;
+    if (_messageBoundaries)
+    {
+        // Report the full record length so a short read can be detected
+        flags |= MSG_TRUNC;
+    }
+    return recvmsg(_socket, &message, flags);
+#endif
+}
+
+//---------------------------------------------------------------------
+// The kernel leaves quick ack mode on its own, it has to be set again
+// after every read.
+//---------------------------------------------------------------------
+void SocketSidebandData::RearmQuickAck()
+{
+#ifdef __linux__
+    if (_quickAck)
+    {
+        int yes = 1;
+        setsockopt(_socket, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+    }
+#endif
+}
+
+//---------------------------------------------------------------------
+// Receives into the buffers with a single receive call, waiting for
+// data according to the wait policy.  Returns the number of bytes
+// received, for SOCK_SEQPACKET sockets the length of the whole record.
+//---------------------------------------------------------------------
+int64_t SocketSidebandData::ReceiveFromSocket(SocketBuffer* buffers, int count)
+{
+    if (_ioUring)
+    {
+        auto calls = _ioUring->SystemCalls();
+        auto n = _ioUring->Receive(buffers, count, _messageBoundaries, SocketWaitPolicy(), _spinMicroseconds);
+        _receiveCalls += _ioUring->SystemCalls() - calls;
+        RearmQuickAck();
+        return n;
+    }
+    int64_t n = -1;
+    auto policy = SocketWaitPolicy();
+    if (policy == ::SidebandWaitPolicy::BLOCK)
+    {
+        n = ReceiveBuffers(buffers, count, true);
+    }
+    else
+    {
+        auto received = SpinForCondition([&]() {
+            n = ReceiveBuffers(buffers, count, false);
+            return n >= 0 || !SocketWouldBlock();
+        }, policy, _spinMicroseconds);
+        if (!received)
+        {
+            n = ReceiveBuffers(buffers, count, true);
+        }
+    }
+    ++_receiveCalls;
+    RearmQuickAck();
+    return n;
+}
+
+//---------------------------------------------------------------------
+// _record holds bytes that were received before they were asked for:
+// the rest of a SOCK_SEQPACKET record that came with its length prefix,
+// or on stream sockets whatever the kernel had beyond the read.  Stream
+// reads receive into the caller's buffer and the read-ahead buffer in
+// one call, so a length prefix, its message and the messages after it
+// usually take a single receive.
+//---------------------------------------------------------------------
+bool SocketSidebandData::ReadFromSocket(void* buffer, int64_t numBytes)
+{
+    auto remainingBytes = numBytes;
+    char* start = (char*)buffer;
+    if (_recordOffset < _recordLength)
+    {
+        auto count = _recordLength - _recordOffset < remainingBytes ? _recordLength - _recordOffset : remainingBytes;
+        memcpy(start, _record.data() + _recordOffset, count);
+        _recordOffset += count;
+        start += count;
+        remainingBytes -= count;
+    }
+    while (remainingBytes > 0)
+    {
+        auto readAhead = !_messageBoundaries && _readAheadSize > 0;
+        if (readAhead && static_cast<int64_t>(_record.size()) < _readAheadSize)
+        {
+            _record.resize(_readAheadSize);
+        }
+        SocketBuffer socketBuffers[] = {
+            { start, remainingBytes },
+            { reinterpret_cast<char*>(_record.data()), _readAheadSize }
+        };
+        auto n = ReceiveFromSocket(socketBuffers, readAhead ? 2 : 1);
+        if (n <= 0)
+        {
+            std::cout << "Failed To read." << std::endl;
+            return false;
+        }
+        if (n > remainingBytes && _messageBoundaries)
+        {
+            // MSG_TRUNC reports the full record length, the rest of it is lost
+            std::cout << "Sideband record of " << n << " bytes is larger than the read of " << remainingBytes << " bytes." << std::endl;
+            return false;
+        }
+        if (n > remainingBytes)
+        {
+            _recordOffset = 0;
+            _recordLength = n - remainingBytes;
+            n = remainingBytes;
+        }
+        start += n;
+        remainingBytes -= n;
+    }
+    assert(remainingBytes == 0);
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const std::string& SocketSidebandData::UsageId()
+{
+    return _id;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+std::vector<std::string> SplitUrlString(const std::string& s)
+{
+    char delimiter = ':';
+    std::vector<std::string> tokens;
+    std::string token;
+    std::istringstream tokenStream(s);
+    while (std::getline(tokenStream, token, delimiter))
+    {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static const int64_t DefaultHandshakeTimeoutMilliseconds = 5000;
+static const int64_t PendingConnectionLifetimeSeconds = 60;
+
+//---------------------------------------------------------------------
+// 0 turns the timeout off again.
+//---------------------------------------------------------------------
+static void SetReceiveTimeout(SOCKET socket, int64_t milliseconds)
+{
+#ifdef _WIN32
+    DWORD timeout = static_cast<DWORD>(milliseconds);
+#else
+    timeval timeout;
+    timeout.tv_sec = static_cast<time_t>(milliseconds / 1000);
+    timeout.tv_usec = static_cast<suseconds_t>((milliseconds % 1000) * 1000);
+#endif
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) != 0)
+    {
+        std::cout << "Failed to set the handshake timeout: " << GetSocketError() << std::endl;
+    }
+}
+
+//---------------------------------------------------------------------
+// Used where the listener reads the id with blocking calls, the
+// SOCKET_HANDSHAKE_TIMEOUT_MILLISECONDS receive timeout keeps a silent
+// client from holding up the accept thread for longer than that.
+//---------------------------------------------------------------------
+std::string SocketSidebandData::ReadConnectionId(int socket)
+{    
+    SetReceiveTimeout(socket, GetSidebandDefaultProperty(::SidebandProperty::SOCKET_HANDSHAKE_TIMEOUT_MILLISECONDS, DefaultHandshakeTimeoutMilliseconds));
+    std::string id(ConnectIdLength(), '\0');
+    int received = 0;
+    while (received < ConnectIdLength())
+    {
+        auto n = recv(socket, &id[received], ConnectIdLength() - received, 0);
+        if (n <= 0)
+        {
+            std::cout << "Sideband connection closed or timed out during the handshake." << std::endl;
+            return std::string();
+        }
+        received += n;
+    }
+    SetReceiveTimeout(socket, 0);
+    return id;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void SocketSidebandData::QueueSidebandConnection(::SidebandStrategy strategy, const std::string& id, int64_t bufferSize)
+{
+    PendingSocketConnection pending;
+#ifdef _WIN32
+    pending.lowLatency = false;
+#else
+    pending.lowLatency = strategy == ::SidebandStrategy::SOCKETS_LOW_LATENCY;
 #endif
+    pending.bufferSize = bufferSize;
+    pending.stripes = 0;
+    if (strategy == ::SidebandStrategy::SOCKETS_STRIPED)
+    {
+        auto stripes = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_STRIPES, DefaultStripes);
+        pending.stripes = stripes < 1 ? 1 : stripes > MaxStripes ? MaxStripes : stripes;
+    }
+    auto now = std::chrono::steady_clock::now();
+    pending.deadline = now + std::chrono::seconds(PendingConnectionLifetimeSeconds);
+    std::unique_lock<std::mutex> lock(_connectMutex);
+    // Drop sidebands whose client never connected
+    for (auto it = _pendingConnections.begin(); it != _pendingConnections.end(); )
+    {
+        if (it->second.deadline <= now)
+        {
+            std::cout << "Sideband connection " << it->first << " was never made, dropping it." << std::endl;
+            it = _pendingConnections.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    _pendingConnections[id] = pending;
+}
+
+//---------------------------------------------------------------------
+// Settings are looked up by the id the client sends, so any number of
+// sidebands can be queued and their connections can arrive in any
+// order.  An empty connectionId means the id has not been read from
+// the socket yet.  Connections with the id of a striped sideband that
+// is still missing connections become stripes of that sideband.
+// Striped sidebands tell the client how many connections to open in
+// reply to the id.  Connections with an id that was never queued are
+// closed.
+//---------------------------------------------------------------------
+SocketSidebandData* SocketSidebandData::InitFromConnection(int socket, const std::string& connectionId)
+{
+    auto id = connectionId.empty() ? ReadConnectionId(socket) : connectionId;
+    if (id.empty())
+    {
+        CloseSocket(socket);
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(_connectMutex);
+    auto striped = _stripedConnections.find(id);
+    if (striped != _stripedConnections.end())
+    {
+        auto sidebandData = new SocketSidebandData(socket, striped->second->_bufferSize, false);
+        sidebandData->_id = id;
+        sidebandData->InitSocketType();
+        sidebandData->ApplySocketBufferSizes();
+        if (striped->second->AttachStripe(sidebandData))
+        {
+            _stripedConnections.erase(striped);
+        }
+        return sidebandData;
+    }
+    auto queued = _pendingConnections.find(id);
+    if (queued != _pendingConnections.end() && queued->second.deadline <= std::chrono::steady_clock::now())
+    {
+        _pendingConnections.erase(queued);
+        queued = _pendingConnections.end();
+    }
+    if (queued == _pendingConnections.end())
+    {
+        std::cout << "Sideband connection " << id << " was not queued, closing it." << std::endl;
+        lock.unlock();
+        CloseSocket(socket);
+        return nullptr;
+    }
+    auto pending = queued->second;
+    _pendingConnections.erase(queued);
+    auto sidebandData = new SocketSidebandData(socket, pending.bufferSize, pending.lowLatency);
+    sidebandData->_id = id;
+    if (pending.stripes > 1)
+    {
+        _stripedConnections[sidebandData->_id] = sidebandData;
+    }
+    lock.unlock();
+
+    sidebandData->InitSocketType();
+    sidebandData->ApplyLowLatencyOptions();
+    sidebandData->ApplySocketBufferSizes();
+    sidebandData->ApplyWaitPolicy();
+    if (sidebandData->_zeroCopyThreshold > 0)
+    {
+        sidebandData->EnableZeroCopy();
+    }
+    if (pending.stripes > 0)
+    {
+        sidebandData->_stripeCount = pending.stripes;
+        sidebandData->WriteToSocket(&pending.stripes, sizeof(int64_t));
+    }
+    if (sidebandData->_ioUringMode != 0)
+    {
+        sidebandData->EnableIoUring();
+    }
+    RegisterSidebandData(sidebandData);
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketSidebandData* SocketSidebandData::ClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize, bool lowLatency)
+{    
+    auto tokens = SplitUrlString(sidebandServiceUrl);
+    if (tokens.size() != 2)
+    {
+        std::cout << "Invalid socket address " << sidebandServiceUrl << ", expected <host>:<port>" << std::endl;
+        return nullptr;
+    }
+    auto sidebandData = new SocketSidebandData(usageId, bufferSize, lowLatency);
+    sidebandData->ConnectToSocket(tokens[0], tokens[1], usageId, lowLatency);
+    if (sidebandData->_socket == INVALID_SOCKET)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketSidebandData* SocketSidebandData::UnixClientInit(const std::string& path, const std::string& usageId, int64_t bufferSize)
+{
+    auto sidebandData = new SocketSidebandData(usageId, bufferSize, false);
+    sidebandData->ConnectToUnixSocket(path, usageId);
+    if (sidebandData->_socket == INVALID_SOCKET)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketSidebandData* SocketSidebandData::HypervisorClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize)
+{
+    auto tokens = SplitUrlString(sidebandServiceUrl);
+    if (tokens.size() != 2)
+    {
+        std::cout << "Invalid hypervisor socket address " << sidebandServiceUrl << ", expected <cid>:<port>" << std::endl;
+        return nullptr;
+    }
+    auto sidebandData = new SocketSidebandData(usageId, bufferSize, false);
+    sidebandData->ConnectToHypervisorSocket(tokens[0], tokens[1], usageId);
+    if (sidebandData->_socket == INVALID_SOCKET)
+    {
+        delete sidebandData;
+        return nullptr;
+    }
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+// The server replies to the id with the number of connections, the
+// client opens the rest of them with the same id.  A server that does
+// not stripe never replies, the read gives up after the
+// SOCKET_HANDSHAKE_TIMEOUT_MILLISECONDS receive timeout.  Returns
+// nullptr when any of the connections fails.
+//---------------------------------------------------------------------
+SocketSidebandData* SocketSidebandData::StripedClientInit(const std::string& sidebandServiceUrl, const std::string& usageId, int64_t bufferSize)
+{
+    auto tokens = SplitUrlString(sidebandServiceUrl);
+    auto sidebandData = ClientInit(sidebandServiceUrl, usageId, bufferSize, false);
+    if (sidebandData == nullptr)
+    {
+        std::cout << "Failed to connect the striped sideband " << usageId << "." << std::endl;
+        return nullptr;
+    }
+    int64_t stripeCount = 0;
+    SetReceiveTimeout(sidebandData->_socket, GetSidebandDefaultProperty(::SidebandProperty::SOCKET_HANDSHAKE_TIMEOUT_MILLISECONDS, DefaultHandshakeTimeoutMilliseconds));
+    auto read = sidebandData->ReadFromSocket(&stripeCount, sizeof(int64_t));
+    SetReceiveTimeout(sidebandData->_socket, 0);
+    if (!read || stripeCount < 1 || stripeCount > MaxStripes)
+    {
+        std::cout << "Failed to read the stripe count of the sideband." << std::endl;
+        delete sidebandData;
+        return nullptr;
+    }
+    sidebandData->_stripeCount = stripeCount;
+    for (int64_t x = 1; x < stripeCount; ++x)
+    {
+        auto connection = new SocketSidebandData(usageId, bufferSize, false);
+        connection->ConnectToSocket(tokens[0], tokens[1], usageId, false);
+        if (connection->_socket == INVALID_SOCKET)
+        {
+            std::cout << "Failed to connect stripe " << x << " of the sideband " << usageId << "." << std::endl;
+            delete connection;
+            delete sidebandData;
+            return nullptr;
+        }
+        sidebandData->AttachStripe(connection);
+    }
+    return sidebandData;
+}
+
+//---------------------------------------------------------------------
+// Each stripe gets its own I/O thread, with SOCKET_STRIPE_FIRST_CPU the
+// threads are pinned to consecutive cpus starting there.
+//---------------------------------------------------------------------
+bool SocketSidebandData::AttachStripe(SocketSidebandData* connection)
+{
+    std::unique_lock<std::mutex> lock(_stripeMutex);
+    auto firstCpu = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_STRIPE_FIRST_CPU, -1);
+    auto cpu = firstCpu < 0 ? -1 : firstCpu + static_cast<int64_t>(_stripes.size());
+    _stripes.emplace_back(new SocketStripe(connection, cpu));
+    _stripesAttached.notify_all();
+    return static_cast<int64_t>(_stripes.size()) + 1 >= _stripeCount;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::IsStriped(int64_t byteCount)
+{
+    return _stripeCount > 1 && byteCount >= MinimumStripedBytes;
+}
+
+//---------------------------------------------------------------------
+// Cuts the frame into one slice per connection.  Slices only depend on
+// the frame size so the reader finds the same slices on the same
+// connections, each connection keeps its slices in order.  The first
+// slice goes over this connection on the calling thread, together with
+// the length prefix if there is one.
+//---------------------------------------------------------------------
+bool SocketSidebandData::TransferStriped(bool write, char* data, int64_t byteCount, SocketBuffer* prefix)
+{
+    {
+        // Server side stripes connect after the sideband is registered,
+        // the client has SOCKET_CONNECT_TIMEOUT_MILLISECONDS to open them.
+        auto timeout = GetSidebandDefaultProperty(::SidebandProperty::SOCKET_CONNECT_TIMEOUT_MILLISECONDS, DefaultConnectTimeoutMilliseconds);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        std::unique_lock<std::mutex> lock(_stripeMutex);
+        while (static_cast<int64_t>(_stripes.size()) + 1 < _stripeCount)
+        {
+            if (_stripesAttached.wait_until(lock, deadline) == std::cv_status::timeout && static_cast<int64_t>(_stripes.size()) + 1 < _stripeCount)
+            {
+                std::cout << "Only " << _stripes.size() + 1 << " of " << _stripeCount << " stripes of the sideband connected." << std::endl;
+                return false;
+            }
+        }
+    }
+    auto sliceSize = (byteCount + _stripeCount - 1) / _stripeCount;
+    for (size_t x = 0; x < _stripes.size(); ++x)
+    {
+        auto offset = static_cast<int64_t>(x + 1) * sliceSize;
+        auto length = offset < byteCount ? byteCount - offset : 0;
+        _stripes[x]->Begin(write, data + (length > 0 ? offset : 0), length < sliceSize ? length : sliceSize);
+    }
+    auto firstSlice = sliceSize < byteCount ? sliceSize : byteCount;
+    bool result = false;
+    if (write)
+    {
+        SocketBuffer frame[] = {
+            prefix != nullptr ? *prefix : SocketBuffer { nullptr, 0 },
+            { data, firstSlice }
+        };
+        result = WriteBuffersToSocket(frame, 2) && WaitForZeroCopy(_zeroCopySends);
+    }
+    else
+    {
+        result = ReadFromSocket(data, firstSlice);
+    }
+    for (auto& stripe : _stripes)
+    {
+        result = stripe->Finish() && result;
+    }
+    return result;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::Write(const uint8_t* bytes, int64_t byteCount)
+{
+    if (IsStriped(byteCount))
+    {
+        return TransferStriped(true, const_cast<char*>(reinterpret_cast<const char*>(bytes)), byteCount, nullptr);
+    }
+    return WriteToSocket(bytes, byteCount);    
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::Read(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    auto read = IsStriped(bufferSize) ? TransferStriped(false, reinterpret_cast<char*>(bytes), bufferSize, nullptr) : ReadFromSocket(bytes, bufferSize);
+    if (read)
+    {
+        *numBytesRead = bufferSize;
+        return true;
+    }
+    return false;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::WriteLengthPrefixed(const uint8_t* bytes, int64_t byteCount)
+{
+    auto payloadSize = _compression && byteCount <= _bufferSize ? _compression->Compress(bytes, byteCount) : 0;
+    if (payloadSize != 0)
+    {
+        return WriteFrame(payloadSize | CompressedFrame, _compression->Payload(), payloadSize) && WaitForZeroCopy(_zeroCopySends);
+    }
+    return WriteFrame(byteCount, bytes, byteCount) && WaitForZeroCopy(_zeroCopySends);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::WriteFrame(int64_t prefix, const uint8_t* bytes, int64_t byteCount)
+{
+    if (IsStriped(byteCount))
+    {
+        SocketBuffer prefixBuffer { reinterpret_cast<char*>(&prefix), sizeof(int64_t) };
+        return TransferStriped(true, const_cast<char*>(reinterpret_cast<const char*>(bytes)), byteCount, &prefixBuffer);
+    }
+    SocketBuffer frame[] = {
+        { reinterpret_cast<char*>(&prefix), sizeof(int64_t) },
+        { const_cast<char*>(reinterpret_cast<const char*>(bytes)), byteCount }
+    };
+    return WriteBuffersToSocket(frame, 2);
+}
+
+//---------------------------------------------------------------------
+// Direct writes alternate between two send buffers so the next message
+// can be serialized while the kernel still holds the previous one for
+// a zero copy send.  The length prefix is stored in front of the data
+// so a frame is one contiguous buffer.
+//---------------------------------------------------------------------
+uint8_t* SocketSidebandData::BeginDirectWrite()
+{
+    auto& buffer = _sendBuffers[_sendBuffer];
+    if (buffer == nullptr)
+    {
+        buffer = AllocateNumaBuffer(_bufferSize + sizeof(int64_t), _numaPolicy, _numaNode);
+    }
+    if (buffer == nullptr || !WaitForZeroCopy(_sendBufferSends[_sendBuffer]))
+    {
+        return nullptr;
+    }
+    return buffer + sizeof(int64_t);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::FinishDirectWrite(int64_t byteCount)
+{
+    auto buffer = _sendBuffers[_sendBuffer];
+    if (buffer == nullptr || byteCount > _bufferSize)
+    {
+        return false;
+    }
+    auto payloadSize = _compression ? _compression->Compress(buffer + sizeof(int64_t), byteCount) : 0;
+    if (payloadSize != 0)
+    {
+        return WriteFrame(payloadSize | CompressedFrame, _compression->Payload(), payloadSize) && WaitForZeroCopy(_zeroCopySends);
+    }
+    *reinterpret_cast<int64_t*>(buffer) = byteCount;
+    if (IsStriped(byteCount))
+    {
+        SocketBuffer prefix { reinterpret_cast<char*>(buffer), sizeof(int64_t) };
+        if (!TransferStriped(true, reinterpret_cast<char*>(buffer + sizeof(int64_t)), byteCount, &prefix))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        SocketBuffer frame { reinterpret_cast<char*>(buffer), byteCount + static_cast<int64_t>(sizeof(int64_t)) };
+        if (!WriteBuffersToSocket(&frame, 1))
+        {
+            return false;
+        }
+    }
+    _sendBufferSends[_sendBuffer] = _zeroCopySends;
+    _sendBuffer = (_sendBuffer + 1) % 2;
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Grows the receive buffer if a message is larger than the sideband
+// buffer size.
+//---------------------------------------------------------------------
+uint8_t* SocketSidebandData::ReceiveBuffer(int64_t byteCount)
+{
+    if (byteCount > _receiveBufferSize || _receiveBuffer == nullptr)
+    {
+        FreeNumaBuffer(_receiveBuffer, _receiveBufferSize);
+        _receiveBufferSize = byteCount > _bufferSize ? byteCount : _bufferSize;
+        _receiveBuffer = AllocateNumaBuffer(_receiveBufferSize, _numaPolicy, _numaNode);
+        if (_receiveBuffer == nullptr)
+        {
+            _receiveBufferSize = 0;
+        }
+    }
+    return _receiveBuffer;
+}
+
+//---------------------------------------------------------------------
+// Direct reads return the message in place when the SOCK_SEQPACKET
+// record with the length prefix held all of it, otherwise it is
+// received into the sideband's receive buffer.  The data stays valid
+// until FinishDirectRead.
+//---------------------------------------------------------------------
+const uint8_t* SocketSidebandData::BeginDirectRead(int64_t byteCount)
+{
+    if (_decompressed != nullptr)
+    {
+        auto data = _decompressed;
+        _decompressed = nullptr;
+        return data;
+    }
+    if (_recordLength - _recordOffset >= byteCount)
+    {
+        auto data = _record.data() + _recordOffset;
+        _recordOffset += byteCount;
+        return data;
+    }
+    auto buffer = ReceiveBuffer(byteCount);
+    int64_t numBytesRead = 0;
+    if (buffer == nullptr || !Read(buffer, byteCount, &numBytesRead))
+    {
+        return nullptr;
+    }
+    return buffer;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+const uint8_t* SocketSidebandData::BeginDirectReadLengthPrefixed(int64_t* bufferSize)
+{
+    *bufferSize = ReadLengthPrefix();
+    return BeginDirectRead(*bufferSize);
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::FinishDirectRead()
+{
+    return true;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketSidebandData::ReadFromLengthPrefixed(uint8_t* bytes, int64_t bufferSize, int64_t* numBytesRead)
+{
+    if (_decompressed != nullptr)
+    {
+        auto count = _decompressedLength < bufferSize ? _decompressedLength : bufferSize;
+        memcpy(bytes, _decompressed, count);
+        *numBytesRead = count;
+        _decompressed = nullptr;
+        return true;
+    }
+    return Read(bytes, bufferSize, numBytesRead);    
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+int64_t SocketSidebandData::ReadLengthPrefix()
+{
+    int64_t bufferSize = 0;
+    _decompressed = nullptr;
+    if (_messageBoundaries && _recordOffset == _recordLength)
+    {
+        // The writer sends the length and the start of the message as one
+        // record, receive both with one call and keep the payload for Read.
+        _record.resize(UnixSocketMaxRecord - sizeof(int64_t));
+        SocketBuffer frame[] = {
+            { reinterpret_cast<char*>(&bufferSize), sizeof(int64_t) },
+            { reinterpret_cast<char*>(_record.data()), static_cast<int64_t>(_record.size()) }
+        };
+        auto n = ReceiveFromSocket(frame, 2);
+        if (n < static_cast<int64_t>(sizeof(int64_t)) || n > UnixSocketMaxRecord)
+        {
+            std::cout << "Failed To read." << std::endl;
+            return 0;
+        }
+        _recordOffset = 0;
+        _recordLength = n - sizeof(int64_t);
+    }
+    else
+    {
+        ReadFromSocket(&bufferSize, sizeof(int64_t));
+    }
+    if ((bufferSize & CompressedFrame) != 0)
+    {
+        return ReadCompressedFrame(bufferSize & ~CompressedFrame);
+    }
+    return bufferSize;
+}
+
+//---------------------------------------------------------------------
+// Receives and decompresses the whole frame, the following read of the
+// message is served from the decompressed data.  Readers do not need
+// compression turned on, the payload says how it was compressed.
+// Writers only compress frames up to the sideband buffer size, larger
+// sizes in the prefix or the payload header are rejected before
+// anything is allocated for them.
+//---------------------------------------------------------------------
+int64_t SocketSidebandData::ReadCompressedFrame(int64_t payloadSize)
+{
+    if (payloadSize > _bufferSize)
+    {
+        std::cout << "Compressed sideband frame of " << payloadSize << " bytes is larger than the buffer size " << _bufferSize << "." << std::endl;
+        return 0;
+    }
+    auto compression = Decompression();
+    int64_t numBytesRead = 0;
+    if (!Read(compression->PayloadBuffer(payloadSize), payloadSize, &numBytesRead))
+    {
+        return 0;
+    }
+    _decompressed = compression->Decompress(payloadSize, _bufferSize, &_decompressedLength);
+    if (_decompressed == nullptr)
+    {
+        std::cout << "Failed to decompress a sideband frame of " << payloadSize << " bytes." << std::endl;
+        return 0;
+    }
+    return _decompressedLength;
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketStripe::SocketStripe(SocketSidebandData* connection, int64_t cpu) :
+    _connection(connection),
+    _pending(false),
+    _stop(false),
+    _write(false),
+    _data(nullptr),
+    _byteCount(0),
+    _result(true),
+    _thread(&SocketStripe::Run, this, cpu)
+{
+}
 
-    s_SidebandSocketsAddress = address;
-    s_SidebandSocketsPort = port;
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+SocketStripe::~SocketStripe()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+        _ready.notify_all();
+    }
+    _thread.join();
+}
 
-    // create a socket
-    sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sockfd < 0)
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void SocketStripe::Begin(bool write, char* data, int64_t byteCount)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _write = write;
+    _data = data;
+    _byteCount = byteCount;
+    _pending = true;
+    _ready.notify_all();
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+bool SocketStripe::Finish()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_pending)
     {
-       std::cout << "Unable to open socket. Sideband streaming will be disabled." << std::endl;
-       return -1;
+        _done.wait(lock);
     }
+    return _result;
+}
 
-    memset((char *) &serv_addr, 0, sizeof(serv_addr));
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+void SocketStripe::Run(int64_t cpu)
+{
+    if (cpu >= 0)
+    {
+#if defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(static_cast<int>(cpu), &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            std::cout << "Failed to pin the stripe thread to cpu " << cpu << std::endl;
+        }
+#elif defined(_WIN32)
+        SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
+#endif
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        while (!_pending && !_stop)
+        {
+            _ready.wait(lock);
+        }
+        if (_stop)
+        {
+            return;
+        }
+        lock.unlock();
+        bool result = true;
+        if (_byteCount > 0)
+        {
+            int64_t numBytesRead = 0;
+            result = _write ?
+                _connection->Write(reinterpret_cast<uint8_t*>(_data), _byteCount) :
+                _connection->Read(reinterpret_cast<uint8_t*>(_data), _byteCount, &numBytesRead);
+        }
+        lock.lock();
+        _result = result;
+        _pending = false;
+        _done.notify_all();
+    }
+}
 
-    serv_addr.sin_family = AF_INET;  
-    serv_addr.sin_addr.s_addr = INADDR_ANY;  
-    serv_addr.sin_port = htons(port);
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+std::string GetSocketsAddress()
+{
+    if (s_SidebandSocketsAddress.length() > 0)
+    {
+        return s_SidebandSocketsAddress;
+    }
+#ifdef ENABLE_RDMA_SIDEBAND
+    auto rdmaAddress = GetRdmaAddress();
+    if (rdmaAddress.length() > 0)
+    {
+        return rdmaAddress;
+    }
+#endif
+    return "localhost";
+}
 
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+std::string GetSocketsPort()
+{
+    if (s_SidebandSocketsPort > 0)
     {
-       std::cout << "Unable to bind on " << address << ":" << port << ". Sideband streaming will be disabled."<< std::endl;
-       return -1;
+        return std::to_string(s_SidebandSocketsPort);
     }
+    return "50055";
+}
 
-    listen(sockfd, 5);
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+std::string GetUnixSocketsPath()
+{
+    if (s_SidebandUnixSocketsPath.length() > 0)
+    {
+        return s_SidebandUnixSocketsPath;
+    }
+#ifdef __linux__
+    return "@ni_grpc_sideband_sockets_" + std::to_string(getpid());
+#else
+    return "ni_grpc_sideband.sock";
+#endif
+}
 
-    std::cout << "Listening for sideband sockets at: " << address << ":" << port << std::endl;
+//---------------------------------------------------------------------
+// The context id clients use to reach this side is the local one, the
+// host's is always VMADDR_CID_HOST.  Without a vsock device the
+// loopback context id is used.
+//---------------------------------------------------------------------
+std::string GetHypervisorSocketsAddress()
+{
+    unsigned int cid = 1;
+#ifdef __linux__
+    cid = VMADDR_CID_LOCAL;
+    auto vsock = open("/dev/vsock", O_RDONLY | O_CLOEXEC);
+    if (vsock >= 0)
+    {
+        unsigned int localCid = 0;
+        if (ioctl(vsock, IOCTL_VM_SOCKETS_GET_LOCAL_CID, &localCid) == 0)
+        {
+            cid = localCid;
+        }
+        close(vsock);
+    }
+#endif
+    auto port = s_SidebandHypervisorSocketsPort > 0 ? s_SidebandHypervisorSocketsPort : 50057;
+    return std::to_string(cid) + ":" + std::to_string(port);
+}
+
+//---------------------------------------------------------------------
+// Sets up an accepted connection on its own thread.  Setup can block,
+// on the stripe count write or the io_uring setup, and must not hold up
+// the accept loop and the other connections it serves.
+//---------------------------------------------------------------------
+static void StartConnectionSetup(SOCKET connection, const std::string& connectionId)
+{
+    std::thread setupThread([connection, connectionId]() { SocketSidebandData::InitFromConnection(connection, connectionId); });
+    setupThread.detach();
+}
+
+#ifdef __linux__
+//---------------------------------------------------------------------
+// A connection that has been accepted but has not sent its whole
+// connection id yet.
+//---------------------------------------------------------------------
+struct PendingHandshake
+{
+    std::string connectionId;
+    int received;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+//---------------------------------------------------------------------
+// Reads what has arrived of the connection id without blocking.
+// Returns true when the handshake is over, successful or not, in which
+// case the connection is no longer watched by the accept loop.
+//---------------------------------------------------------------------
+static bool ContinueHandshake(int epollfd, int connection, PendingHandshake& handshake)
+{
+    while (handshake.received < ConnectIdLength())
+    {
+        auto n = recv(connection, &handshake.connectionId[handshake.received], ConnectIdLength() - handshake.received, 0);
+        if (n < 0 && SocketWouldBlock())
+        {
+            return false;
+        }
+        if (n <= 0)
+        {
+            std::cout << "Sideband connection closed during the handshake." << std::endl;
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, connection, nullptr);
+            close(connection);
+            return true;
+        }
+        handshake.received += n;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, connection, nullptr);
+    fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) & ~O_NONBLOCK);
+    StartConnectionSetup(connection, handshake.connectionId);
+    return true;
+}
+
+//---------------------------------------------------------------------
+// Event driven accept loop.  New connections are accepted in batches
+// and their handshakes run without blocking, so a slow client only
+// holds up its own connection.  A connection stays registered until its
+// handshake is over.  Handshakes that take longer than the handshake
+// timeout are dropped.
+//---------------------------------------------------------------------
+static int32_t RunSidebandSocketsAcceptLoop(SOCKET sockfd, std::atomic<bool>& stop_flag)
+{
+    auto handshakeTimeout = std::chrono::milliseconds(GetSidebandDefaultProperty(::SidebandProperty::SOCKET_HANDSHAKE_TIMEOUT_MILLISECONDS, DefaultHandshakeTimeoutMilliseconds));
+    auto epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0)
+    {
+        std::cout << "ERROR on epoll_create" << std::endl;
+        return -1;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    epoll_event listenEvent {};
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.fd = sockfd;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &listenEvent);
 
+    std::map<int, PendingHandshake> handshakes;
+    const int MaxEvents = 64;
+    epoll_event events[MaxEvents];
+    while (!stop_flag.load())
+    {
+        int activity = epoll_wait(epollfd, events, MaxEvents, handshakes.empty() ? 1000 : 100);
+        if (activity < 0 && errno != EINTR)
+        {
+            std::cout << "ERROR on epoll_wait" << std::endl;
+            break;
+        }
+        for (int x = 0; x < activity; ++x)
+        {
+            auto fd = events[x].data.fd;
+            if (fd == sockfd)
+            {
+                while (true)
+                {
+                    auto newsockfd = accept4(sockfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (newsockfd < 0)
+                    {
+                        if (!SocketWouldBlock() && errno != ECONNABORTED && errno != EINTR)
+                        {
+                            std::cout << "ERROR on accept " << errno << std::endl;
+                        }
+                        break;
+                    }
+                    std::cout << "Connection!" << std::endl;
+                    auto& handshake = handshakes[newsockfd];
+                    handshake.connectionId.assign(ConnectIdLength(), '\0');
+                    handshake.received = 0;
+                    handshake.deadline = std::chrono::steady_clock::now() + handshakeTimeout;
+                    epoll_event connectionEvent {};
+                    connectionEvent.events = EPOLLIN | EPOLLRDHUP;
+                    connectionEvent.data.fd = newsockfd;
+                    epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &connectionEvent);
+                }
+                continue;
+            }
+            auto it = handshakes.find(fd);
+            if (it == handshakes.end())
+            {
+                continue;
+            }
+            if (ContinueHandshake(epollfd, fd, it->second))
+            {
+                handshakes.erase(it);
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = handshakes.begin(); it != handshakes.end(); )
+        {
+            if (it->second.deadline > now)
+            {
+                ++it;
+                continue;
+            }
+            std::cout << "Sideband connection handshake timed out." << std::endl;
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, it->first, nullptr);
+            close(it->first);
+            it = handshakes.erase(it);
+        }
+    }
+    for (auto& handshake : handshakes)
+    {
+        close(handshake.first);
+    }
+    close(epollfd);
+    return 0;
+}
+#else
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int32_t RunSidebandSocketsAcceptLoop(SOCKET sockfd, std::atomic<bool>& stop_flag)
+{
     while (!stop_flag.load())
     {
         fd_set read_fds;
@@ -416,27 +2549,231 @@ int32_t _SIDEBAND_FUNC RunSidebandSocketsAccept(const char* address, int port, s
 
         if (FD_ISSET(sockfd, &read_fds))
         {
-            sockaddr_in cli_addr{};
-            clilen = sizeof(cli_addr);
-            newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-            if (newsockfd < 0)
+            auto newsockfd = accept(sockfd, nullptr, nullptr);
+            if (!IsValidSocket(newsockfd))
             { 
                 std::cout << "ERROR on accept" << std::endl;
                 return -1;
             }
 
             std::cout << "Connection!" << std::endl;
-            SocketSidebandData::InitFromConnection(newsockfd);
+            StartConnectionSetup(newsockfd, std::string());
+        }
+    }
+    return 0;
+}
+#endif
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static int ListenBacklog()
+{
+    return static_cast<int>(GetSidebandDefaultProperty(::SidebandProperty::SOCKET_ACCEPT_BACKLOG, SOMAXCONN));
+}
+
+//---------------------------------------------------------------------
+//---------------------------------------------------------------------
+static SOCKET OpenSocketsListener(const char* address, int port, bool reusePort)
+{
+    struct sockaddr_in serv_addr;
+
+    // create a socket
+    auto sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (!IsValidSocket(sockfd))
+    {
+       std::cout << "Unable to open socket. Sideband streaming will be disabled." << std::endl;
+       return sockfd;
+    }
+
+#ifdef SO_REUSEPORT
+    if (reusePort)
+    {
+        // Each accept thread listens on its own socket and the kernel
+        // spreads new connections over them.
+        int yes = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char*)&yes, sizeof(yes));
+    }
+#endif
+
+    memset((char *) &serv_addr, 0, sizeof(serv_addr));
+
+    serv_addr.sin_family = AF_INET;  
+    serv_addr.sin_addr.s_addr = INADDR_ANY;  
+    serv_addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    {
+       std::cout << "Unable to bind on " << address << ":" << port << ". Sideband streaming will be disabled."<< std::endl;
+       CloseSocket(sockfd);
+       return static_cast<SOCKET>(-1);
+    }
+
+    ApplyConfiguredSocketBufferSizes(sockfd);
+    listen(sockfd, ListenBacklog());
+    return sockfd;
+}
+
+//---------------------------------------------------------------------
+// With SOCKET_ACCEPT_THREADS above 1 each thread gets its own
+// SO_REUSEPORT listener so connection setup is spread over cores.
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC RunSidebandSocketsAccept(const char* address, int port, std::atomic<bool>& stop_flag)
+{
+#ifdef _WIN32
+    WSADATA wsaData {};
+    WSAStartup(MAKEWORD(2,2), &wsaData);
+#endif
+
+    s_SidebandSocketsAddress = address;
+    s_SidebandSocketsPort = port;
+
+    int threadCount = 1;
+#ifdef SO_REUSEPORT
+    threadCount = static_cast<int>(GetSidebandDefaultProperty(::SidebandProperty::SOCKET_ACCEPT_THREADS, 1));
+    if (threadCount < 1)
+    {
+        threadCount = 1;
+    }
+#endif
+
+    std::vector<SOCKET> listeners;
+    for (int x = 0; x < threadCount; ++x)
+    {
+        auto sockfd = OpenSocketsListener(address, port, threadCount > 1);
+        if (!IsValidSocket(sockfd))
+        {
+            for (auto listener : listeners)
+            {
+                CloseSocket(listener);
+            }
+            return -1;
         }
+        listeners.push_back(sockfd);
+    }
+
+    std::cout << "Listening for sideband sockets at: " << address << ":" << port << std::endl;
+
+    std::vector<std::thread> acceptThreads;
+    for (int x = 1; x < threadCount; ++x)
+    {
+        auto sockfd = listeners[x];
+        acceptThreads.emplace_back([sockfd, &stop_flag]() { RunSidebandSocketsAcceptLoop(sockfd, stop_flag); });
+    }
+    auto result = RunSidebandSocketsAcceptLoop(listeners[0], stop_flag);
+    if (result != 0)
+    {
+        // Stop the other accept threads too
+        stop_flag.store(true);
+    }
+    for (auto& acceptThread : acceptThreads)
+    {
+        acceptThread.join();
     }
 
     std::cout << "Closing socket..." << std::endl;
+    for (auto listener : listeners)
+    {
+        CloseSocket(listener);
+    }
+    return result;
+}
 
+//---------------------------------------------------------------------
+// Same host listener for UNIX_SOCKETS.  An empty path picks a default,
+// on Linux an abstract name that is unique to this process.
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC RunSidebandUnixSocketsAccept(const char* path, std::atomic<bool>& stop_flag)
+{
 #ifdef _WIN32
-    closesocket(sockfd);
+    WSADATA wsaData {};
+    WSAStartup(MAKEWORD(2,2), &wsaData);
+#endif
+
+    s_SidebandUnixSocketsPath = path != nullptr ? path : "";
+    auto socketPath = GetUnixSocketsPath();
+    s_SidebandUnixSocketsPath = socketPath;
+
+#ifdef __linux__
+    auto sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (!IsValidSocket(sockfd))
+    {
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
 #else
-    close(sockfd);
+    auto sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 #endif
+    if (!IsValidSocket(sockfd))
+    {
+       std::cout << "Unable to open unix socket. Unix socket sidebands will be disabled." << std::endl;
+       return -1;
+    }
 
-    return 0;
+    sockaddr_un socketAddress;
+    auto addressLength = UnixSocketAddress(socketPath, &socketAddress);
+    if (socketPath[0] != '@')
+    {
+        // Remove the socket file left behind by an earlier listener
+        remove(socketPath.c_str());
+    }
+    if (bind(sockfd, (struct sockaddr*)&socketAddress, addressLength) < 0)
+    {
+       std::cout << "Unable to bind on " << socketPath << ". Unix socket sidebands will be disabled." << std::endl;
+       CloseSocket(sockfd);
+       return -1;
+    }
+
+    listen(sockfd, ListenBacklog());
+
+    std::cout << "Listening for sideband unix sockets at: " << socketPath << std::endl;
+
+    auto result = RunSidebandSocketsAcceptLoop(sockfd, stop_flag);
+
+    std::cout << "Closing socket..." << std::endl;
+    CloseSocket(sockfd);
+    if (socketPath[0] != '@')
+    {
+        remove(socketPath.c_str());
+    }
+    return result;
+}
+
+//---------------------------------------------------------------------
+// Listener for HYPERVISOR_SOCKETS, it accepts connections from any
+// context id.
+//---------------------------------------------------------------------
+int32_t _SIDEBAND_FUNC RunSidebandHypervisorSocketsAccept(int port, std::atomic<bool>& stop_flag)
+{
+#ifdef __linux__
+    s_SidebandHypervisorSocketsPort = port;
+    auto sockfd = socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (!IsValidSocket(sockfd))
+    {
+       std::cout << "Unable to open hypervisor socket. Hypervisor socket sidebands will be disabled." << std::endl;
+       return -1;
+    }
+
+    sockaddr_vm socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.svm_family = AF_VSOCK;
+    socketAddress.svm_cid = VMADDR_CID_ANY;
+    socketAddress.svm_port = static_cast<unsigned int>(port);
+    if (bind(sockfd, (struct sockaddr*)&socketAddress, sizeof(socketAddress)) < 0)
+    {
+       std::cout << "Unable to bind on hypervisor socket port " << port << ". Hypervisor socket sidebands will be disabled." << std::endl;
+       CloseSocket(sockfd);
+       return -1;
+    }
+
+    listen(sockfd, ListenBacklog());
+
+    std::cout << "Listening for sideband hypervisor sockets at: " << GetHypervisorSocketsAddress() << std::endl;
+
+    auto result = RunSidebandSocketsAcceptLoop(sockfd, stop_flag);
+    std::cout << "Closing socket..." << std::endl;
+    CloseSocket(sockfd);
+    return result;
+#else
+    std::cout << "Hypervisor sockets are only supported on Linux." << std::endl;
+    return -1;
+#endif
 }